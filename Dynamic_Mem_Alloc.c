@@ -3,17 +3,89 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <execinfo.h>
+#ifdef HEAP_THREAD_SAFE
+#include <pthread.h>
+#include <errno.h>
+#endif
+#ifdef HEAP_MALLOC_SHIM
+#include <malloc.h>
+#endif
 #include "p4Heap.h"
  
+/*
+ * Header words hold block sizes, free list links and heap offsets.
+ * They are size_t wide, so a heap can be as large as the address space
+ * allows. Compact-header mode (compile with -DHEAP_COMPACT_HEADER) uses
+ * 4-byte words instead, which halves the per-block overhead and limits a
+ * heap to HEAP_MAX_SIZE, just under 4 GiB.
+ */
+#ifdef HEAP_COMPACT_HEADER
+typedef unsigned int heapWord;
+#define HEAP_MAX_SIZE ((size_t)0xFFFFF000)
+#else
+typedef size_t heapWord;
+#define HEAP_MAX_SIZE (~(size_t)0 >> 2)
+#endif
+
+/*
+ * Payload alignment, 8 bytes unless built with -DHEAP_ALIGNMENT=16, which
+ * the malloc shim does to match malloc's guarantee, see HEAP_MALLOC_SHIM.
+ * Block sizes and slab objects are multiples of it, so every payload is
+ * aligned once the first block's is, see FIRST_BLOCK_OFFSET.
+ */
+#if defined(HEAP_MALLOC_SHIM) && !defined(HEAP_ALIGNMENT)
+#define HEAP_ALIGNMENT 16
+#endif
+#ifndef HEAP_ALIGNMENT
+#define HEAP_ALIGNMENT 8
+#endif
+#if HEAP_ALIGNMENT != 8 && HEAP_ALIGNMENT != 16
+#error "HEAP_ALIGNMENT must be 8 or 16"
+#endif
+
+/*
+ * Error messages go to stderr, except in the malloc shim where stdio
+ * could call back into malloc.
+ */
+#ifdef HEAP_MALLOC_SHIM
+#define heap_error(...) ((void)0)
+#else
+#define heap_error(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
+/*
+ * Debug build (compile with -DHEAP_DEBUG):
+ *   Every heap block ends in a canary of at least HEAP_CANARY_SIZE bytes
+ *   behind the requested payload. Its last word holds the requested size
+ *   and every byte before it is HEAP_CANARY_BYTE, see canary_set(). bfree,
+ *   brealloc and heap_check() reject a block whose canary was overwritten.
+ *   Freed payloads are filled with HEAP_POISON_BYTE, so a use after free
+ *   reads garbage instead of the old data. There are no slab runs, so
+ *   that every request gets a block and a canary of its own; blocks with
+ *   a mapping of their own have no canary.
+ */
+#ifdef HEAP_DEBUG
+#define HEAP_CANARY_SIZE (8 + sizeof(heapWord))
+#define HEAP_CANARY_BYTE 0xCB
+#define HEAP_CANARY_WORD ((heapWord)0x5CA1AB1E5CA1AB1EULL)
+#define HEAP_POISON_BYTE 0xDD
+#else
+#define HEAP_CANARY_SIZE 0
+#endif
+
 /*
  * This structure serves as the header for each allocated and free block.
  * It also serves as the footer for each free block but only containing size.
  */
 typedef struct blockHeader {           
 
-    int size_status;
+    heapWord size_status;
 
     /*
      * Size of the block is always a multiple of 8.
@@ -27,283 +99,5251 @@ typedef struct blockHeader {
      *   Bit1 => second last bit 
      *   Bit1 == 0 => previous block is free
      *   Bit1 == 1 => previous block is allocated
+     *
+     *   Bit2 == 1 => block has a mapping of its own, see map_block()
      * 
      * Start Heap: 
-     *  The blockHeader for the first block of the heap is after skip 4 bytes.
+     *  The blockHeader for the first block of the heap is after skip one
+     *  header word.
      *  This ensures alignment requirements can be met.
      * 
      * End Mark: 
      *  The end of the available memory is indicated using a size_status of 1.
+     *  Its p-bit is kept like any other header's, so the end mark is a
+     *  header with size 0 and a size_status of 1 or 3.
      * 
      */
 } blockHeader;         
 
+/*
+ * Free blocks are also kept on explicit doubly linked free lists, one list
+ * per size class. The links are stored in the first two words of the free
+ * block's payload as byte offsets from the start of the mapped region, so
+ * each link fits in a header word. Offset 0 is the NULL link because no
+ * block header can start at the first byte of the region.
+ *
+ * A free block must therefore hold a header, two links and a footer,
+ * which makes MIN_BLOCK_SIZE the smallest block the heap ever creates.
+ */
+typedef struct freeLinks {
+    heapWord next;
+    heapWord prev;
+} freeLinks;
+
+#define MIN_BLOCK_SIZE ((int)((2 * sizeof(blockHeader) + sizeof(freeLinks) + HEAP_ALIGNMENT - 1) / HEAP_ALIGNMENT * HEAP_ALIGNMENT))
+
+/*
+ * Size classes:
+ *   Blocks up to SMALL_CLASS_MAX bytes get one class per multiple of 8,
+ *   so every block on a small list is an exact fit for its class.
+ *   Larger blocks are grouped in power-of-two ranges up to TREE_MIN_SIZE.
+ *   The last class holds every block of at least TREE_MIN_SIZE bytes.
+ *   It is not a list but a tree ordered by size, see tree_insert().
+ */
+#define SMALL_CLASS_MAX   128
+#define NUM_SMALL_CLASSES ((SMALL_CLASS_MAX - MIN_BLOCK_SIZE) / 8 + 1)
+#define TREE_MIN_SIZE     4096
+#define TREE_CLASS        (NUM_SMALL_CLASSES + 5)
+#define NUM_CLASSES       (TREE_CLASS + 1)
+
+/*
+ * Free blocks in the tree class use the link words as the offsets of
+ * their left and right children.
+ */
+typedef struct treeLinks {
+    heapWord left;
+    heapWord right;
+} treeLinks;
+
+/*
+ * Slab runs serve requests of up to SLAB_MAX bytes, see slab_alloc().
+ */
+#define SLAB_MAX          128
+#define SLAB_RUN_SIZE     4096
+#define SLAB_RUN_SHIFT    12
+#define NUM_SLAB_CLASSES  ((SLAB_MAX - 16) / 8 + 1)
+#define SLAB_FREE_WORDS   ((SLAB_RUN_SIZE / 16 + 63) / 64)
+
+/*
+ * An arena is an independent heap: one mapped region with its own block
+ * list and free lists. init_heap() sets up the default arena that is used
+ * by balloc(), bfree(), coalesce() and disp_heap(). arena_create() maps
+ * more arenas, which are used through the arena_* functions.
+ *
+ * The struct of the default arena is static, so its region keeps the
+ * layout described above. Every other arena keeps its struct at the start
+ * of its own region, in front of the first block, so destroying it is a
+ * single munmap.
+ *
+ * Thread-safe mode (compile with -DHEAP_THREAD_SAFE -pthread):
+ *   Each arena's lock protects its block headers and free lists.
+ *   Slab objects of the default arena are also cached per thread, see the
+ *   thread cache functions below heap_bfree().
+ *   A created arena belongs to one owner thread; other threads' frees go
+ *   on its remote free queue, see remote_push().
+ */
+struct arena {
+    char *base;                   // start of the mapped region
+    size_t map_size;              // bytes mapped at base
+    blockHeader *heap_start;      // first block
+    size_t alloc_size;            // bytes from heap_start to the end mark
+    size_t reserve_size;          // bytes of address space reserved at base
+    size_t trim_off;              // first page of the top free block given
+                                  // back to the O.S. or never touched, 0
+                                  // if none, see zero_payload()
+    int flags;                    // HEAP_* flags the region was mapped with
+    int fd;                       // file of a HEAP_FILE region, -1 if none
+    int corrupt;                  // set once a shared heap's blocks could
+                                  // not be repaired, see arena_lock();
+                                  // nothing is allocated or freed then
+    blockHeader *coalesce_next;   // where coalesce_step() goes on, NULL
+                                  // for heap_start
+    blockHeader *rover;           // where the next HEAP_NEXT_FIT search
+                                  // starts, NULL for heap_start
+    size_t mmap_threshold;        // requests this large get a mapping of
+                                  // their own, 0 for none, see map_block()
+
+    // counters kept up to date by every operation, heap_stats() derives
+    // the remaining fields from them
+    heapStats stats;
+
+    // heads of the segregated free lists as link offsets, by size class
+    heapWord free_lists[NUM_CLASSES];
+    // bit i is set when free_lists[i] is non-empty
+    unsigned long long free_list_map;
+
+    // heads of the lists of slab runs with free objects, by slab class
+    heapWord slab_runs[NUM_SLAB_CLASSES];
+    // bit i is set when a slab run starts at base + i * SLAB_RUN_SIZE,
+    // NULL if the arena has no slab runs
+    unsigned long long *slab_map;
+    // bit i is set when the payload of an allocated block starts at
+    // base + i * 8, NULL if it could not be mapped, see block_map_set()
+    unsigned long long *block_map;
+
+    // handle table, see heap_balloc_handle(), NULL until the first handle
+    struct handleEntry *handles;
+    size_t handle_slots;          // entries mapped at handles
+    size_t handles_used;          // entries ever handed out
+    size_t free_handle;           // first free entry, index + 1, 0 if none
+
+#ifdef HEAP_THREAD_SAFE
+    pthread_mutex_t lock;
+    pthread_t owner;              // thread that allocates from the arena
+    int has_owner;                // 0 for the default arena
+    void *remote_frees;           // blocks freed by other threads, linked
+                                  // through their first payload word
+    unsigned long long *queued_map; // bit i is set while the payload at
+                                  // base + i * 8 is on remote_frees, NULL
+                                  // without block_map, see queued_set()
+#endif
+};
+
+/* Size of the struct in front of the first block of a created arena.
+ */
+#define ARENA_HEADER_SIZE ((int)((sizeof(arena) + 7) / 8 * 8))
+
+/* Offset from base of the first block header behind front bytes. At least
+ * one header word is skipped so that the payload can be aligned.
+ */
+#define FIRST_BLOCK_OFFSET(front) (((front) + 2 * sizeof(blockHeader) + HEAP_ALIGNMENT - 1) / HEAP_ALIGNMENT * HEAP_ALIGNMENT - sizeof(blockHeader))
+
+/*
+ * Heap files, see init_heap_file().
+ *
+ * A heap file is the default arena's region mapped MAP_SHARED: a
+ * heapFile header, then the blocks. Headers hold sizes and free list
+ * links hold offsets, so the blocks are valid wherever the file ends up
+ * mapped. The arena struct itself stays in memory and is rebuilt from the
+ * block chain when a file is attached again.
+ */
+#define HEAP_FILE_MAGIC   "p4heap1"
+#ifdef HEAP_DEBUG
+#define HEAP_FILE_VERSION 2       // blocks end in canaries, see HEAP_DEBUG
+#else
+#define HEAP_FILE_VERSION 1
+#endif
+
+typedef struct heapFile {
+    char magic[8];                // HEAP_FILE_MAGIC, written last
+    unsigned int version;         // HEAP_FILE_VERSION
+    unsigned int word_size;       // sizeof(heapWord) of the build
+    unsigned int alignment;       // HEAP_ALIGNMENT of the build
+    unsigned int arena_size;      // sizeof(arena) of a shared heap, see
+                                  // arena_open_shm(), 0 for a file
+    unsigned long long map_size;  // bytes of the file the heap spans
+    unsigned long long root;      // offset of the root block's payload, 0
+                                  // for none, see heap_set_root()
+    unsigned long long address;   // where the file was last mapped
+} heapFile;
+
+#define FILE_HEADER_SIZE ((int)((sizeof(heapFile) + 7) / 8 * 8))
+
+#ifdef HEAP_THREAD_SAFE
+static arena default_arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+#else
+static arena default_arena;
+#endif
+
 /* Global variable  
  * It must point to the first block in the heap and is set by init_heap()
+ * It is the first block of the default arena.
  */
 blockHeader *heap_start = NULL;     
 
 /* Size of heap allocation padded to round to nearest page size.
+ * Mirrors the default arena's alloc_size.
  */
-int alloc_size;
- 
-/* 
- * Function for allocating 'size' bytes of heap memory.
- * Argument size: requested size for the payload
- * Returns address of allocated block (payload) on success.
- * Returns NULL on failure.
- *
- * This function must:
- * - Check size - Return NULL if size < 1 
- * - Determine block size rounding up to a multiple of 8 
- *   and possibly adding padding as a result.
- *
- * - Use BEST-FIT PLACEMENT POLICY to chose a free block
- *
- * - If the BEST-FIT block that is found is exact size match
- *   - 1. Update all heap blocks as needed for any affected blocks
- *   - 2. Return the address of the allocated block payload
- *
- * - If the BEST-FIT block that is found is large enough to split 
- *   - 1. SPLIT the free block into two valid heap blocks:
- *         1. an allocated block
- *         2. a free block
- *         NOTE: both blocks must meet heap block requirements 
- *       - Update all heap block header(s) and footer(s) 
- *              as needed for any affected blocks.
- *   - 2. Return the address of the allocated block payload
- *
- *   Return if NULL unable to find and allocate block for required size
+size_t alloc_size;
+
+/*
+ * Growing and trimming:
+ *   Each arena reserves HEAP_RESERVE_SIZE bytes of address space (or just
+ *   its initial size if the reservation fails) and only the first map_size
+ *   bytes are accessible. When no free block fits, balloc makes more of the
+ *   reservation accessible, at least HEAP_GROW_MIN bytes or a quarter of
+ *   map_size, and moves the end mark. The region never moves, so payload
+ *   addresses stay valid.
  *
- * Payload address that is returned is NOT the address of the
- *       block header.  It is the address of the start of the 
- *       available memory for the requesterr.
+ *   When bfree leaves a free block of at least HEAP_TRIM_THRESHOLD bytes
+ *   at the end of the heap, the whole pages inside it are given back to
+ *   the O.S. with madvise(MADV_DONTNEED). They read as zero when reused.
+ */
+#ifndef HEAP_RESERVE_SIZE
+#define HEAP_RESERVE_SIZE ((size_t)1 << 30)
+#endif
+#ifndef HEAP_GROW_MIN
+#define HEAP_GROW_MIN (64 * 1024)
+#endif
+#ifndef HEAP_TRIM_THRESHOLD
+#define HEAP_TRIM_THRESHOLD (128 * 1024)
+#endif
+
+/*
+ * Huge pages and pre-faulting, see init_heap_flags():
+ *   HEAP_HUGE_PAGES first tries to map the region with MAP_HUGETLB. Those
+ *   pages are reserved when mapped, so such a heap is rounded up to whole
+ *   HEAP_HUGE_PAGE_SIZE pages and does not grow. HEAP_HUGE_PAGE_SIZE must
+ *   be the system's default huge page size. If no huge pages are free the
+ *   reservation is mapped as usual, aligned to HEAP_HUGE_PAGE_SIZE and
+ *   marked with madvise(MADV_HUGEPAGE) so transparent huge pages can back
+ *   it. If the kernel supports neither, normal pages are used.
  *
+ *   HEAP_POPULATE faults in every accessible page up front, and the new
+ *   pages each time the heap grows, so first touches of blocks never fault.
  */
-void* balloc(int size) {     
-    if (size < 1) {
-	    return NULL;
-    }
+#ifndef HEAP_HUGE_PAGE_SIZE
+#define HEAP_HUGE_PAGE_SIZE ((size_t)2 << 20)
+#endif
 
-    // block size rounding up to multiple of 8
-    int blockSize = ((size + sizeof(blockHeader) + 7) / 8) * 8;
+/*
+ * Placement policies, chosen by the flags of init_heap_flags() and
+ * arena_create_flags():
+ *   default        best fit: the smallest free block that is large enough.
+ *   HEAP_GOOD_FIT  the first free block found in the best size class that
+ *                  is at most HEAP_GOOD_FIT_SLACK percent too large, or the
+ *                  best of the first HEAP_GOOD_FIT_CANDIDATES that fit.
+ *   HEAP_NEXT_FIT  the first free block that fits in address order,
+ *                  going on from the previous one (roving next fit).
+ * Best fit already stops early on exact matches. Good fit mostly saves
+ * walking long range-class lists; next fit walks allocated blocks too,
+ * so it is cheap only while free space is spread evenly over the heap.
+ */
+#ifndef HEAP_GOOD_FIT_SLACK
+#define HEAP_GOOD_FIT_SLACK 12
+#endif
+#ifndef HEAP_GOOD_FIT_CANDIDATES
+#define HEAP_GOOD_FIT_CANDIDATES 4
+#endif
 
-    blockHeader *current = heap_start;
-    blockHeader *bestFit = NULL;
+/* Defined with the heap files below init_heap().
+ */
+static int heap_recover(arena *a);
 
-    // while not at end of heap
-    while (current->size_status != 1) {
-	    // remove status bits to get the size
-	    int currentSize = current->size_status >> 2 << 2;
-	    // if block is free and large enough
-	    if (!(current->size_status & 1) && currentSize >= blockSize) {
-		    // if it is the first fit or better fit
-		    if (bestFit == NULL || currentSize < (bestFit->size_status >> 2 << 2)) {
-			    bestFit = current;
-			    // if exact size match
-			    if (currentSize == blockSize) {
-				    break;
-			    }
-		    }
+/*
+ * Functions for taking and releasing an arena's lock.
+ * They do nothing unless built in thread-safe mode.
+ */
+static void arena_lock(arena *a) {
+#ifdef HEAP_THREAD_SAFE
+    // only a shared heap's lock is robust, its holder may have died
+    // halfway through changing the blocks; if they cannot be repaired
+    // no block is handed out or freed from then on
+    if (pthread_mutex_lock(&a->lock) == EOWNERDEAD) {
+	    pthread_mutex_consistent(&a->lock);
+	    if (!a->corrupt && heap_recover(a) != 0) {
+		    a->corrupt = 1;
+		    heap_error("Error:mem.c: Shared heap is corrupt, it is no longer used\n");
 	    }
-	    // move to next block
-	    current = (blockHeader*)((char*)current + currentSize);
     }
+#else
+    (void)a;
+#endif
+}
 
-    // cannot find best-fit block
-    if (bestFit == NULL) {
-	    return NULL;
+static void arena_unlock(arena *a) {
+#ifdef HEAP_THREAD_SAFE
+    pthread_mutex_unlock(&a->lock);
+#else
+    (void)a;
+#endif
+}
+ 
+/*
+ * Function for mapping a block size to its free list size class.
+ * Argument size: block size, a multiple of 8 and at least MIN_BLOCK_SIZE.
+ * Returns the index into free_lists for blocks of that size.
+ */
+static int size_class(size_t size) {
+    if (size <= SMALL_CLASS_MAX) {
+	    return (size - MIN_BLOCK_SIZE) / 8;
+    }
+    if (size >= TREE_MIN_SIZE) {
+	    return TREE_CLASS;
     }
 
-    int remainder = (bestFit->size_status >> 2 << 2) - blockSize;
-    // if remainder block large enough to split
-    if (remainder >= sizeof(blockHeader) * 2 + 8) {
-	    // update header of allocated block
-	    bestFit->size_status = blockSize | (bestFit->size_status & 3) | 1;
-	    // split block
-	    blockHeader *newBlock = (blockHeader*)((char*)bestFit + blockSize);
-	    // update header of free block
-	    newBlock->size_status = remainder | 2;
-	    // update footer of the free block
-	    blockHeader *nextBlock = (blockHeader*)((char*)newBlock + remainder);
-	    // if not at end of heap
-	    if (nextBlock->size_status != 1) {
-		    // set previous block allocated bit
-		    nextBlock->size_status |= 2;
-	    }
+    int cls = NUM_SMALL_CLASSES;
+    size_t limit = SMALL_CLASS_MAX * 2;
+    // find the power-of-two range holding size
+    while (size >= limit) {
+	    limit <<= 1;
+	    cls++;
     }
-    // if remainder block too small
-    else {
-	    // update header of allocated block
-	    bestFit->size_status |= 1;
-	    // get next block
-	    blockHeader *nextBlock = (blockHeader*)((char*)bestFit + (bestFit->size_status >> 2 << 2));
-	    // if not end of heap
-	    if (nextBlock->size_status != 1) {
-		    // set previous block allocated bit
-		    nextBlock->size_status |= 2;
+    return cls;
+}
+
+/*
+ * Helpers for the free list links stored in a free block's payload.
+ */
+static freeLinks* links_of(blockHeader *block) {
+    return (freeLinks*)(block + 1);
+}
+
+static blockHeader* link_to_block(arena *a, heapWord offset) {
+    return offset ? (blockHeader*)(a->base + offset) : NULL;
+}
+
+static heapWord block_to_link(arena *a, blockHeader *block) {
+    return block ? (heapWord)((char*)block - a->base) : 0;
+}
+
+/*
+ * Tree of large free blocks.
+ *
+ * Blocks of at least TREE_MIN_SIZE bytes are kept in a treap: a binary
+ * search tree ordered by size, then by address, that is also a heap on a
+ * priority hashed from the block's offset. The hashed priorities keep the
+ * tree balanced in expectation, so insert, remove and best-fit search are
+ * O(log n) without storing any balance information in the block.
+ * The root's offset is free_lists[TREE_CLASS].
+ */
+static treeLinks* tree_links_of(blockHeader *block) {
+    return (treeLinks*)(block + 1);
+}
+
+static unsigned int tree_priority(heapWord offset) {
+    return (unsigned int)(((unsigned long long)offset * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+/*
+ * Function for ordering two tree blocks, returns non-zero if block1 goes
+ * first.
+ */
+static int tree_before(blockHeader *block1, blockHeader *block2) {
+    size_t size1 = block1->size_status & ~3;
+    size_t size2 = block2->size_status & ~3;
+    return size1 < size2 || (size1 == size2 && block1 < block2);
+}
+
+/*
+ * Function for inserting a block into the subtree at root.
+ * Returns the new root of the subtree.
+ */
+static heapWord tree_insert(arena *a, heapWord root, blockHeader *block) {
+    if (root == 0) {
+	    tree_links_of(block)->left = 0;
+	    tree_links_of(block)->right = 0;
+	    return block_to_link(a, block);
+    }
+
+    blockHeader *node = link_to_block(a, root);
+    treeLinks *links = tree_links_of(node);
+    if (tree_before(block, node)) {
+	    links->left = tree_insert(a, links->left, block);
+	    // rotate right if the new child has the higher priority
+	    treeLinks *child = tree_links_of(link_to_block(a, links->left));
+	    if (tree_priority(links->left) > tree_priority(root)) {
+		    heapWord newRoot = links->left;
+		    links->left = child->right;
+		    child->right = root;
+		    return newRoot;
+	    }
+    } else {
+	    links->right = tree_insert(a, links->right, block);
+	    // rotate left if the new child has the higher priority
+	    treeLinks *child = tree_links_of(link_to_block(a, links->right));
+	    if (tree_priority(links->right) > tree_priority(root)) {
+		    heapWord newRoot = links->right;
+		    links->right = child->left;
+		    child->left = root;
+		    return newRoot;
 	    }
     }
+    return root;
+}
 
-    return bestFit + 1;
-} 
- 
-/* 
- * Function for freeing up a previously allocated block.
- * Argument ptr: address of the block to be freed up.
- * Returns 0 on success.
- * Returns -1 on failure.
- * This function:
- * - Return -1 if ptr is NULL.
- * - Return -1 if ptr is not a multiple of 8.
- * - Return -1 if ptr is outside of the heap space.
- * - Return -1 if ptr block is already freed.
- * - Update header(s) and footer as needed.
- */                    
-int bfree(void *ptr) {
-    // if ptr is NULL, not mulitple of 8 or outside of heap space
-    if (!ptr || (unsigned long)ptr % 8 != 0 || ptr < (void*)(heap_start + 1) || ptr >= (void*)((char*)heap_start + alloc_size)) {
-	    return -1;
+/*
+ * Function for joining two subtrees where every block of left goes
+ * before every block of right.
+ * Returns the root of the joined tree.
+ */
+static heapWord tree_join(arena *a, heapWord left, heapWord right) {
+    if (left == 0 || right == 0) {
+	    return left ? left : right;
+    }
+    if (tree_priority(left) > tree_priority(right)) {
+	    treeLinks *links = tree_links_of(link_to_block(a, left));
+	    links->right = tree_join(a, links->right, right);
+	    return left;
     }
+    treeLinks *links = tree_links_of(link_to_block(a, right));
+    links->left = tree_join(a, left, links->left);
+    return right;
+}
 
-    // get the block header
-    blockHeader *block = (blockHeader*)ptr - 1;
-    // if block is already freed
-    if (!(block->size_status & 1)) {
-	    return -1;
+/*
+ * Function for removing a block from the subtree at root.
+ * The block's size must not have changed since it was inserted.
+ * Returns the new root of the subtree.
+ */
+static heapWord tree_remove(arena *a, heapWord root, blockHeader *block) {
+    blockHeader *node = link_to_block(a, root);
+    treeLinks *links = tree_links_of(node);
+
+    if (node == block) {
+	    return tree_join(a, links->left, links->right);
     }
+    if (tree_before(block, node)) {
+	    links->left = tree_remove(a, links->left, block);
+    } else {
+	    links->right = tree_remove(a, links->right, block);
+    }
+    return root;
+}
 
-    // mark block as free
-    block->size_status &= ~1;
+/*
+ * Function for finding the smallest tree block of at least blockSize
+ * bytes, the lowest addressed one if several have that size.
+ * Argument goodEnough: 0 for best fit, else stop at the first fitting
+ *   block of at most goodEnough bytes or after HEAP_GOOD_FIT_CANDIDATES
+ *   fitting blocks, see HEAP_GOOD_FIT.
+ * Returns NULL if no block in the tree is large enough.
+ */
+static blockHeader* tree_best_fit(arena *a, size_t blockSize, size_t goodEnough) {
+    blockHeader *bestFit = NULL;
+    blockHeader *current = link_to_block(a, a->free_lists[TREE_CLASS]);
+    int fits = 0;
 
-    // get next block
-    blockHeader *nextBlock = (blockHeader*)((char*)block + (block->size_status & ~3));
-    // if not at end of heap
-    if (nextBlock->size_status != 1) {
-	    // set previous block allocated bit
-	    nextBlock->size_status &= ~2;
+    while (current != NULL) {
+	    if ((current->size_status & ~3) >= blockSize) {
+		    // fits, a better fit can only be to the left
+		    bestFit = current;
+		    if (goodEnough != 0 && ((current->size_status & ~3) <= goodEnough ||
+				    ++fits >= HEAP_GOOD_FIT_CANDIDATES)) {
+			    break;
+		    }
+		    current = link_to_block(a, tree_links_of(current)->left);
+	    } else {
+		    current = link_to_block(a, tree_links_of(current)->right);
+	    }
     }
+    return bestFit;
+}
 
-    // freed the block
-    return 0;
-} 
+/*
+ * Function for pushing a free block on the front of its size class list.
+ * The block header must already hold the block's size.
+ */
+static void free_list_insert(arena *a, blockHeader *block) {
+    int cls = size_class(block->size_status >> 2 << 2);
+
+    a->stats.free_blocks++;
+    a->stats.bytes_free += block->size_status >> 2 << 2;
+
+    if (cls == TREE_CLASS) {
+	    a->free_lists[cls] = tree_insert(a, a->free_lists[cls], block);
+	    a->free_list_map |= 1ULL << cls;
+	    return;
+    }
+
+    blockHeader *head = link_to_block(a, a->free_lists[cls]);
+
+    links_of(block)->prev = 0;
+    links_of(block)->next = a->free_lists[cls];
+    if (head != NULL) {
+	    links_of(head)->prev = block_to_link(a, block);
+    }
+    a->free_lists[cls] = block_to_link(a, block);
+    a->free_list_map |= 1ULL << cls;
+}
 
 /*
- * Function for traversing heap block list and coalescing all adjacent 
- * free blocks.
- *
- * This function is used for user-called coalescing.
- * Updated header size_status and footer size_status as needed.
+ * Function for unlinking a free block from its size class list.
+ * Must be called before the size in the block header is changed.
  */
-int coalesce() {
-    blockHeader *current = heap_start;
+static void free_list_remove(arena *a, blockHeader *block) {
+    int cls = size_class(block->size_status >> 2 << 2);
 
-    // while we are not at end of the heap
-    while (current->size_status != 1) {
-	    // if current block is free
-	    if (!(current->size_status & 1)) {
-		    // get next block
-		    blockHeader *nextBlock = (blockHeader*)((char*)current + (current->size_status & ~3));
-		    // while next block is free and not at end of heap
-		    while (nextBlock->size_status != 1 && !(nextBlock->size_status & 1)) {
-			    // get new next block
-			    current->size_status += (nextBlock->size_status & ~3);
-			    nextBlock = (blockHeader*)((char*)current + (current->size_status & ~3));
-		    }
+    a->stats.free_blocks--;
+    a->stats.bytes_free -= block->size_status >> 2 << 2;
 
-		    // if not at end of heap
-		    if (nextBlock->size_status != 1) {
-			    // set previous block allocated bit
-			    nextBlock->size_status |= 2;
-		    }
+    if (cls == TREE_CLASS) {
+	    a->free_lists[cls] = tree_remove(a, a->free_lists[cls], block);
+	    if (a->free_lists[cls] == 0) {
+		    a->free_list_map &= ~(1ULL << cls);
 	    }
-	    // move to next block
-	    current = (blockHeader*)((char*)current + (current->size_status & ~3));
+	    return;
     }
 
-	    // coalesced all adjacent free blocks
-    return 0;
+    blockHeader *next = link_to_block(a, links_of(block)->next);
+    blockHeader *prev = link_to_block(a, links_of(block)->prev);
+
+    if (prev != NULL) {
+	    links_of(prev)->next = links_of(block)->next;
+    } else {
+	    a->free_lists[cls] = links_of(block)->next;
+	    if (next == NULL) {
+		    a->free_list_map &= ~(1ULL << cls);
+	    }
+    }
+    if (next != NULL) {
+	    links_of(next)->prev = links_of(block)->prev;
+    }
 }
 
- 
-/* 
- * Function used to initialize the memory allocator.
- * Intended to be called ONLY once by a program.
- * Argument sizeOfRegion: the size of the heap space to be allocated.
- * Returns 0 on success.
- * Returns -1 on failure.
- */                    
-int init_heap(int sizeOfRegion) {    
- 
-    static int allocated_once = 0; //prevent multiple myInit calls
- 
-    int   pagesize; // page size
-    int   padsize;  // size of padding when heap size not a multiple of page size
-    void* mmap_ptr; // pointer to memory mapped area
-    int   fd;
+/*
+ * Function for writing the footer of a free block.
+ * The footer is the last word of the block and holds only the size.
+ */
+static void set_footer(blockHeader *block, size_t size) {
+    blockHeader *footer = (blockHeader*)((char*)block + size - sizeof(blockHeader));
+    footer->size_status = size;
+}
 
-    blockHeader* end_mark;
-  
-    if (0 != allocated_once) {
-        fprintf(stderr, 
-        "Error:mem.c: InitHeap has allocated space during a previous call\n");
-        return -1;
+/*
+ * Function for keeping coalesce_step()'s cursor and the next-fit rover on
+ * a block header when the header at gone is merged into the block at into.
+ */
+static void merge_cursor(arena *a, blockHeader *gone, blockHeader *into) {
+    if (a->coalesce_next == gone) {
+	    a->coalesce_next = into;
     }
-
-    if (sizeOfRegion <= 0) {
-        fprintf(stderr, "Error:mem.c: Requested block size is not positive\n");
-        return -1;
+    if (a->rover == gone) {
+	    a->rover = into;
     }
+}
 
-    // Get the pagesize from O.S. 
-    pagesize = getpagesize();
+/*
+ * Helpers for reading a header and updating the p-bit of the next block.
+ * In thread-safe mode bfree reads the header of an allocated block without
+ * the arena lock while another thread may be changing that header's p-bit, so
+ * these accesses are atomic. Nothing else in an allocated block's header
+ * changes until it is freed.
+ */
+static heapWord load_header(blockHeader *block) {
+#ifdef HEAP_THREAD_SAFE
+    return __atomic_load_n(&block->size_status, __ATOMIC_RELAXED);
+#else
+    return block->size_status;
+#endif
+}
+
+static void set_pbit(blockHeader *block) {
+#ifdef HEAP_THREAD_SAFE
+    __atomic_fetch_or(&block->size_status, 2, __ATOMIC_RELAXED);
+#else
+    block->size_status |= 2;
+#endif
+}
+
+static void clear_pbit(blockHeader *block) {
+#ifdef HEAP_THREAD_SAFE
+    __atomic_fetch_and(&block->size_status, ~2, __ATOMIC_RELAXED);
+#else
+    block->size_status &= ~2;
+#endif
+}
+
+/*
+ * Function for writing the header that makes a split or merge visible.
+ * The headers and footers inside the block are written first, and the
+ * store is not moved in front of them, so a process that dies halfway
+ * leaves a chain heap_recover() can walk either way.
+ */
+static void publish_header(blockHeader *block, heapWord sizeStatus) {
+    __atomic_store_n(&block->size_status, sizeStatus, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function for checking for the end mark, the only header with size 0.
+ */
+static int is_end_mark(blockHeader *block) {
+    return (block->size_status >> 2 << 2) == 0;
+}
+
+/*
+ * Function for reading an arena's heap size without its lock, see ptr_to_block().
+ * It only ever grows, so a stale value is still valid for blocks that exist.
+ */
+static size_t load_alloc_size(arena *a) {
+#ifdef HEAP_THREAD_SAFE
+    return __atomic_load_n(&a->alloc_size, __ATOMIC_RELAXED);
+#else
+    return a->alloc_size;
+#endif
+}
+
+/*
+ * Function for computing the block size balloc uses for a payload size:
+ * payload plus header (and canary, see HEAP_DEBUG) rounded up to a multiple
+ * of HEAP_ALIGNMENT, at least MIN_BLOCK_SIZE.
+ */
+static size_t block_size_for(size_t size) {
+    // block size rounding up to multiple of HEAP_ALIGNMENT
+    size_t blockSize = ((size + sizeof(blockHeader) + HEAP_CANARY_SIZE + HEAP_ALIGNMENT - 1) / HEAP_ALIGNMENT) * HEAP_ALIGNMENT;
+    // every block must be able to hold the free list links once freed
+    if (blockSize < MIN_BLOCK_SIZE) {
+	    blockSize = MIN_BLOCK_SIZE;
+    }
+    return blockSize;
+}
+
+/*
+ * Function for writing the canary of an allocated block behind its first
+ * size bytes, see HEAP_DEBUG. Does nothing in other builds.
+ * Caller has sized the block with block_size_for(size) or larger.
+ */
+static void canary_set(blockHeader *block, size_t size) {
+#ifdef HEAP_DEBUG
+    char *payload = (char*)(block + 1);
+    heapWord *sizeWord = (heapWord*)((char*)block + (block->size_status & ~3)) - 1;
+    *sizeWord = (heapWord)size ^ HEAP_CANARY_WORD;
+    // a remote free links the block through its first payload word, see
+    // remote_push(), so the canary never starts before its end
+    if (size < sizeof(void*)) {
+	    size = sizeof(void*);
+    }
+    memset(payload + size, HEAP_CANARY_BYTE, (char*)sizeWord - (payload + size));
+#else
+    (void)block;
+    (void)size;
+#endif
+}
+
+/*
+ * Function for finding the payload size of an allocated heap block: the
+ * size it was requested with in the debug build, its usable bytes in
+ * other builds.
+ * Returns 0 if the block's canary was overwritten.
+ */
+static size_t payload_size(blockHeader *block) {
+    size_t usable = (block->size_status & ~3) - sizeof(blockHeader);
+#ifdef HEAP_DEBUG
+    heapWord *sizeWord = (heapWord*)((char*)block + (block->size_status & ~3)) - 1;
+    size_t size = *sizeWord ^ HEAP_CANARY_WORD;
+    size_t covered = size < sizeof(void*) ? sizeof(void*) : size;
+    if (size == 0 || covered > usable - HEAP_CANARY_SIZE) {
+	    return 0;
+    }
+    // the bytes in between are few, blocks are split when the rest is
+    // large enough to be a block of its own
+    for (unsigned char *c = (unsigned char*)(block + 1) + covered; c < (unsigned char*)sizeWord; c++) {
+	    if (*c != HEAP_CANARY_BYTE) {
+		    return 0;
+	    }
+    }
+    return size;
+#else
+    return usable;
+#endif
+}
+
+/*
+ * Helpers for the bitmaps of slab runs and the block map.
+ * In thread-safe mode bfree and remote_push() read them without the arena
+ * lock, see load_header(), so they are always accessed atomically there.
+ */
+static unsigned long long load_bits(unsigned long long *word) {
+#ifdef HEAP_THREAD_SAFE
+    return __atomic_load_n(word, __ATOMIC_RELAXED);
+#else
+    return *word;
+#endif
+}
+
+static void set_bits(unsigned long long *word, unsigned long long mask) {
+#ifdef HEAP_THREAD_SAFE
+    __atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+#else
+    *word |= mask;
+#endif
+}
+
+static void clear_bits(unsigned long long *word, unsigned long long mask) {
+#ifdef HEAP_THREAD_SAFE
+    __atomic_fetch_and(word, ~mask, __ATOMIC_RELAXED);
+#else
+    *word &= ~mask;
+#endif
+}
+
+/*
+ * Functions for the block map, one bit per 8 bytes of an arena's
+ * reservation, set at the payload of every allocated block. Every place
+ * a block becomes allocated sets its bit and free_block() clears it, so
+ * ptr_to_block() rejects a pointer into the middle of a block, or garbage
+ * that happens to follow a word with the a-bit set, in O(1). Slab objects
+ * have no bits, the payload of their run has one. The map is reserved like
+ * slab_map and only touched where the heap is; it is only changed under
+ * the arena lock.
+ *
+ * In thread-safe mode the same mapping holds a second map of queued bits
+ * behind it, see queued_set().
+ */
+static size_t block_map_bytes(size_t reserveSize) {
+    size_t bytes = (reserveSize / 8 + 63) / 64 * 8;
+#ifdef HEAP_THREAD_SAFE
+    bytes *= 2;
+#endif
+    return bytes;
+}
+
+static size_t block_map_index(arena *a, blockHeader *block) {
+    return ((char*)(block + 1) - a->base) / 8;
+}
+
+static void block_map_set(arena *a, blockHeader *block) {
+    if (a->block_map != NULL) {
+	    size_t i = block_map_index(a, block);
+	    set_bits(&a->block_map[i / 64], 1ULL << (i % 64));
+    }
+}
+
+static void block_map_clear(arena *a, blockHeader *block) {
+    if (a->block_map != NULL) {
+	    size_t i = block_map_index(a, block);
+	    clear_bits(&a->block_map[i / 64], 1ULL << (i % 64));
+    }
+}
+
+/* Returns 1 if block is marked allocated, or if the arena has no map.
+ */
+static int block_map_test(arena *a, blockHeader *block) {
+    if (a->block_map == NULL) {
+	    return 1;
+    }
+    size_t i = block_map_index(a, block);
+    return (load_bits(&a->block_map[i / 64]) >> (i % 64)) & 1;
+}
+
+/*
+ * Functions for the queued bits, one per 8 bytes of the reservation like
+ * the block map, set at a block or slab object from when remote_push()
+ * queues it until remote_drain() frees it. A queued block is no longer
+ * the caller's to free, resize or queue again. They live behind the block
+ * map in its mapping, queued_map is NULL if there is none or outside of
+ * thread-safe mode.
+ */
+static int queued_test(arena *a, void *ptr) {
+#ifdef HEAP_THREAD_SAFE
+    if (a->queued_map == NULL) {
+	    return 0;
+    }
+    size_t i = ((char*)ptr - a->base) / 8;
+    return (load_bits(&a->queued_map[i / 64]) >> (i % 64)) & 1;
+#else
+    (void)a;
+    (void)ptr;
+    return 0;
+#endif
+}
+
+#ifdef HEAP_THREAD_SAFE
+/* Returns 0 if ptr was not queued yet, -1 if it was.
+ */
+static int queued_set(arena *a, void *ptr) {
+    size_t i = ((char*)ptr - a->base) / 8;
+    unsigned long long old = __atomic_fetch_or(&a->queued_map[i / 64], 1ULL << (i % 64), __ATOMIC_RELAXED);
+    return (old >> (i % 64)) & 1 ? -1 : 0;
+}
+
+static void queued_clear(arena *a, void *ptr) {
+    size_t i = ((char*)ptr - a->base) / 8;
+    clear_bits(&a->queued_map[i / 64], 1ULL << (i % 64));
+}
+#endif
+
+/*
+ * Function for finding the header of an allocated block from its payload.
+ * Returns NULL if ptr is NULL, not aligned, outside of the heap
+ * space, not the start of a block's payload or if its block is already
+ * freed or queued to be freed, see queued_set().
+ */
+static blockHeader* ptr_to_block(arena *a, void *ptr) {
+    // if ptr is NULL, not mulitple of 8 or outside of heap space, or
+    // the heap's blocks cannot be trusted
+    if (a->corrupt || !ptr || (unsigned long)ptr % HEAP_ALIGNMENT != 0 || ptr < (void*)(a->heap_start + 1) || ptr >= (void*)((char*)a->heap_start + load_alloc_size(a))) {
+	    return NULL;
+    }
+
+    // get the block header
+    blockHeader *block = (blockHeader*)ptr - 1;
+    // if block is already freed
+    if (!(load_header(block) & 1)) {
+	    return NULL;
+    }
+    // if ptr is inside a block or points at a stale header
+    if (!block_map_test(a, block) || queued_test(a, ptr)) {
+	    return NULL;
+    }
+    return block;
+}
+
+/*
+ * Function for finding the BEST-FIT free block for blockSize bytes.
+ * Only size classes that can hold blockSize are searched. The first
+ * non-empty class that has a large enough block contains the best fit,
+ * since every block in a higher class is bigger. The tree class is
+ * searched in O(log n) instead of walking a list.
+ * Returns NULL if no free block is large enough.
+ */
+static blockHeader* find_best_fit(arena *a, size_t blockSize) {
+    // classes at or above the one for blockSize that have free blocks
+    unsigned long long candidates = a->free_list_map & (~0ULL << size_class(blockSize));
+    size_t goodEnough = 0;
+    if (a->flags & HEAP_GOOD_FIT) {
+	    goodEnough = blockSize + blockSize * HEAP_GOOD_FIT_SLACK / 100;
+    }
+
+    while (candidates) {
+	    int cls = __builtin_ctzll(candidates);
+	    if (cls == TREE_CLASS) {
+		    return tree_best_fit(a, blockSize, goodEnough);
+	    }
+	    blockHeader *bestFit = NULL;
+	    size_t bestSize = 0;
+	    int fits = 0;
+
+	    blockHeader *current = link_to_block(a, a->free_lists[cls]);
+	    while (current != NULL) {
+		    size_t currentSize = current->size_status >> 2 << 2;
+		    // if it is large enough and the first fit or better fit
+		    if (currentSize >= blockSize && (bestFit == NULL || currentSize < bestSize)) {
+			    bestFit = current;
+			    bestSize = currentSize;
+			    // if exact size match
+			    if (currentSize == blockSize) {
+				    break;
+			    }
+		    }
+		    // a good fit settles for a close enough or the best of a few
+		    if (goodEnough != 0 && currentSize >= blockSize &&
+				    (currentSize <= goodEnough || ++fits >= HEAP_GOOD_FIT_CANDIDATES)) {
+			    break;
+		    }
+		    current = link_to_block(a, links_of(current)->next);
+	    }
+
+	    if (bestFit != NULL) {
+		    return bestFit;
+	    }
+	    // nothing fits in this class, try the next non-empty one
+	    candidates &= candidates - 1;
+    }
+    return NULL;
+}
+
+/*
+ * Function for faulting in the pages of a freshly mapped, still zero-filled
+ * range, see HEAP_POPULATE.
+ */
+static void populate_pages(char *start, size_t size) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(start, size, MADV_POPULATE_WRITE) == 0) {
+	    return;
+    }
+#endif
+    // older kernels, writing a zero to each page faults it in
+    size_t pagesize = getpagesize();
+    for (size_t off = 0; off < size; off += pagesize) {
+	    ((volatile char*)start)[off] = 0;
+    }
+}
+
+/*
+ * Function for making more of an arena's reservation accessible, so that
+ * a free block of at least blockSize bytes exists at the end of the heap.
+ * The old end mark becomes the header of the new space, which is merged
+ * with the last block if that one is free.
+ * Returns 0 on success.
+ * Returns -1 if the reservation is used up or mprotect fails.
+ */
+static int heap_grow(arena *a, size_t blockSize) {
+    // nothing left to grow into, or the heap was never set up
+    if (a->map_size == a->reserve_size) {
+	    return -1;
+    }
+
+    int pagesize = getpagesize();
+    blockHeader *end_mark = (blockHeader*)((char*)a->heap_start + a->alloc_size);
+
+    // a free last block is merged with the new space, so less is needed
+    size_t lastSize = 0;
+    if (!(end_mark->size_status & 2)) {
+	    lastSize = (end_mark - 1)->size_status;
+    }
+    size_t needed = blockSize - lastSize;
+
+    size_t growSize = needed;
+    if (growSize < HEAP_GROW_MIN) {
+	    growSize = HEAP_GROW_MIN;
+    }
+    if (growSize < a->map_size / 4) {
+	    growSize = a->map_size / 4;
+    }
+    growSize = (growSize + pagesize - 1) / pagesize * pagesize;
+    // near the end of the reservation take whatever is left
+    if (growSize > a->reserve_size - a->map_size) {
+	    growSize = a->reserve_size - a->map_size;
+	    if (growSize < needed) {
+		    return -1;
+	    }
+    }
+    // a heap file is extended first, its pages past the end would fault
+    if ((a->flags & HEAP_FILE) && ftruncate(a->fd, a->map_size + growSize) != 0) {
+	    return -1;
+    }
+    if (mprotect(a->base + a->map_size, growSize, PROT_READ | PROT_WRITE) != 0) {
+	    return -1;
+    }
+    if (a->flags & HEAP_POPULATE) {
+	    populate_pages(a->base + a->map_size, growSize);
+    }
+
+    // the old end mark is the header of the new free block
+    blockHeader *block = end_mark;
+    size_t size = growSize;
+    if (lastSize) {
+	    block = (blockHeader*)((char*)end_mark - lastSize);
+	    free_list_remove(a, block);
+	    merge_cursor(a, end_mark, block);
+	    a->stats.merges++;
+	    size += lastSize;
+    }
+    // Set the new end mark, its previous block is free
+    ((blockHeader*)((char*)block + size))->size_status = 1;
+    set_footer(block, size);
+    publish_header(block, size | (block->size_status & 2));
+    free_list_insert(a, block);
+
+    // the new pages have never been touched
+    a->trim_off = a->map_size;
+    a->stats.grows++;
+    a->map_size += growSize;
+    if (a->flags & HEAP_FILE) {
+	    ((heapFile*)a->base)->map_size = a->map_size;
+    }
+#ifdef HEAP_THREAD_SAFE
+    __atomic_store_n(&a->alloc_size, a->alloc_size + growSize, __ATOMIC_RELAXED);
+#else
+    a->alloc_size += growSize;
+#endif
+    if (a == &default_arena) {
+	    alloc_size = a->alloc_size;
+    }
+    return 0;
+}
+
+/*
+ * Function for giving the whole pages inside the free block at the end
+ * of the heap back to the O.S. The header, links and footer are kept.
+ * Pages from trim_off up were given back before and are skipped.
+ * The pages of a heap file or shared heap are punched out of their file
+ * with MADV_REMOVE, as MADV_DONTNEED would only drop them from memory.
+ */
+static void heap_trim(arena *a, blockHeader *top) {
+    unsigned long pagesize = getpagesize();
+    char *lo = (char*)(links_of(top) + 1);
+    char *hi = (char*)top + (top->size_status & ~3) - sizeof(blockHeader);
+
+    lo = (char*)(((unsigned long)lo + pagesize - 1) & ~(pagesize - 1));
+    hi = (char*)((unsigned long)hi & ~(pagesize - 1));
+    if (a->trim_off != 0 && a->base + a->trim_off < hi) {
+	    hi = a->base + a->trim_off;
+    }
+
+    int advice = (a->flags & (HEAP_FILE | HEAP_SHARED)) ? MADV_REMOVE : MADV_DONTNEED;
+    if (lo < hi && madvise(lo, hi - lo, advice) == 0) {
+	    a->trim_off = lo - a->base;
+    }
+}
+
+/*
+ * Function for allocating blockSize bytes at the start of a free block
+ * that has already been taken off its free list.
+ *
+ * - If the block is an exact size match (or the remainder is too small
+ *   to be a block of its own) the whole block is allocated.
+ * - If the block is large enough to split it is SPLIT into two
+ *   valid heap blocks:
+ *     1. an allocated block
+ *     2. a free block
+ *   Both blocks meet heap block requirements.
+ * Argument fitSize: the bytes at bestFit to allocate from, its size or
+ *   more if it takes in the free block behind it, see heap_brealloc().
+ */
+static void place_block(arena *a, blockHeader *bestFit, size_t fitSize, size_t blockSize) {
+    size_t remainder = fitSize - blockSize;
+    block_map_set(a, bestFit);
+    // if remainder block large enough to split
+    if (remainder >= MIN_BLOCK_SIZE) {
+	    a->stats.splits++;
+	    // split block
+	    blockHeader *newBlock = (blockHeader*)((char*)bestFit + blockSize);
+	    // update header of free block
+	    newBlock->size_status = remainder | 2;
+	    // update footer of the free block
+	    set_footer(newBlock, remainder);
+	    // update header of allocated block, which makes the split visible
+	    publish_header(bestFit, blockSize | (bestFit->size_status & 3) | 1);
+	    free_list_insert(a, newBlock);
+	    // the block after the remainder keeps its p-bit clear,
+	    // its previous block is still free
+    }
+    // if remainder block too small
+    else {
+	    // update header of allocated block
+	    publish_header(bestFit, fitSize | (bestFit->size_status & 3) | 1);
+	    // get next block
+	    blockHeader *nextBlock = (blockHeader*)((char*)bestFit + fitSize);
+	    // set previous block allocated bit, also on the end mark
+	    set_pbit(nextBlock);
+    }
+
+    // given back pages this block or the remainder's header covers are in use again
+    if (a->trim_off != 0) {
+	    size_t usedEnd = (char*)bestFit - a->base + (bestFit->size_status >> 2 << 2) + sizeof(blockHeader) + sizeof(freeLinks);
+	    if (usedEnd > a->trim_off) {
+		    a->trim_off = (usedEnd + getpagesize() - 1) / getpagesize() * getpagesize();
+	    }
+    }
+}
+
+/*
+ * Function for finding a free block for blockSize bytes with the
+ * HEAP_NEXT_FIT policy: the first one that is large enough in address
+ * order, starting from where the previous search stopped and wrapping
+ * around at the end mark once.
+ * Returns NULL if no free block is large enough.
+ */
+static blockHeader* find_next_fit(arena *a, size_t blockSize) {
+    blockHeader *start = a->rover != NULL ? a->rover : a->heap_start;
+    blockHeader *current = start;
+
+    for (;;) {
+	    if (is_end_mark(current)) {
+		    current = a->heap_start;
+	    } else {
+		    size_t size = current->size_status & ~3;
+		    if (!(current->size_status & 1) && size >= blockSize) {
+			    a->rover = current;
+			    return current;
+		    }
+		    current = (blockHeader*)((char*)current + size);
+	    }
+	    if (current == start) {
+		    return NULL;
+	    }
+    }
+}
+
+/*
+ * Function for finding a free block for blockSize bytes with the arena's
+ * placement policy, see HEAP_GOOD_FIT and HEAP_NEXT_FIT.
+ * Returns NULL if no free block is large enough.
+ */
+static blockHeader* find_fit(arena *a, size_t blockSize) {
+    if (a->flags & HEAP_NEXT_FIT) {
+	    return find_next_fit(a, blockSize);
+    }
+    return find_best_fit(a, blockSize);
+}
+
+/*
+ * Function for taking the BEST-FIT free block for blockSize bytes off its
+ * free list, growing the heap if no free block is large enough.
+ * Returns NULL if the heap cannot provide such a block or is corrupt,
+ *   see arena_lock().
+ */
+static blockHeader* take_best_fit(arena *a, size_t blockSize) {
+    if (a->corrupt) {
+	    return NULL;
+    }
+    // search only the free lists that can hold blockSize
+    blockHeader *bestFit = find_fit(a, blockSize);
+    // no free block is large enough, try to grow the heap
+    if (bestFit == NULL && heap_grow(a, blockSize) == 0) {
+	    bestFit = find_fit(a, blockSize);
+    }
+
+    if (bestFit != NULL) {
+	    free_list_remove(a, bestFit);
+    }
+    return bestFit;
+}
+
+/*
+ * Function for allocating a block whose payload starts on an 'align'
+ * boundary. The free block found is big enough for any padding, and the
+ * padding in front of the aligned payload is split off as a free block.
+ * Argument align: a power of two, at least 8.
+ * Returns the block header or NULL if there is no space.
+ */
+static blockHeader* alloc_aligned_block(arena *a, size_t size, size_t align) {
+    size_t blockSize = block_size_for(size);
+
+    // leading padding is either 0 or a block of its own
+    blockHeader *block = take_best_fit(a, blockSize + align + MIN_BLOCK_SIZE);
+    if (block == NULL) {
+	    return NULL;
+    }
+
+    unsigned long payload = (unsigned long)(block + 1);
+    unsigned long aligned = (payload + align - 1) & ~(unsigned long)(align - 1);
+    while (aligned != payload && aligned - payload < MIN_BLOCK_SIZE) {
+	    aligned += align;
+    }
+
+    size_t padding = aligned - payload;
+    if (padding > 0) {
+	    a->stats.splits++;
+	    heapWord size_status = block->size_status;
+	    // the aligned block follows a free block
+	    blockHeader *alignedBlock = (blockHeader*)((char*)block + padding);
+	    alignedBlock->size_status = (size_status & ~3) - padding;
+	    // the padding keeps the original p-bit and becomes a free block
+	    set_footer(block, padding);
+	    publish_header(block, padding | (size_status & 2));
+	    free_list_insert(a, block);
+	    block = alignedBlock;
+    }
+
+    place_block(a, block, block->size_status & ~3, blockSize);
+    return block;
+}
+
+/*
+ * Function for freeing an allocated block and coalescing it with its
+ * neighbors, see heap_bfree().
+ */
+static void free_block(arena *a, blockHeader *block) {
+    // mark block as free, this header stays marked even if it is merged
+    // into the previous block so a repeated bfree of ptr still fails
+    block->size_status &= ~1;
+    block_map_clear(a, block);
+    size_t blockSize = block->size_status & ~3;
+#ifdef HEAP_DEBUG
+    // the block was allocated, so it lies below trim_off and bcalloc
+    // clears the poison again, see zero_payload()
+    memset(block + 1, HEAP_POISON_BYTE, blockSize - sizeof(blockHeader));
+#endif
+
+    // get next block
+    blockHeader *nextBlock = (blockHeader*)((char*)block + blockSize);
+    // if next block is free (the end mark is never free) merge it
+    if (!(nextBlock->size_status & 1)) {
+	    free_list_remove(a, nextBlock);
+	    merge_cursor(a, nextBlock, block);
+	    a->stats.merges++;
+	    blockSize += nextBlock->size_status & ~3;
+	    nextBlock = (blockHeader*)((char*)block + blockSize);
+    }
+
+    // if previous block is free merge into it, its size is in its footer
+    if (!(block->size_status & 2)) {
+	    size_t prevSize = (block - 1)->size_status;
+	    blockHeader *prevBlock = (blockHeader*)((char*)block - prevSize);
+	    free_list_remove(a, prevBlock);
+	    merge_cursor(a, block, prevBlock);
+	    a->stats.merges++;
+	    blockSize += prevSize;
+	    block = prevBlock;
+    }
+
+    // update header of the merged block, keeping its p-bit
+    set_footer(block, blockSize);
+    publish_header(block, blockSize | (block->size_status & 2));
+    free_list_insert(a, block);
+
+    // set previous block free bit, also on the end mark
+    clear_pbit(nextBlock);
+
+    // a large free block at the end of the heap gives its pages back
+    if (is_end_mark(nextBlock) && blockSize >= HEAP_TRIM_THRESHOLD) {
+	    heap_trim(a, block);
+    }
+}
+
+/*
+ * Slab runs.
+ *
+ * Requests of up to SLAB_MAX bytes are served from slab runs instead of
+ * getting a block each. A run is one allocated heap block whose payload is
+ * SLAB_RUN_SIZE bytes on a SLAB_RUN_SIZE boundary. It starts with a
+ * slabRun header followed by equal-sized objects without any per-object
+ * header. There is one class per multiple of 8 from 16 to SLAB_MAX bytes.
+ * A bitmap in the run header tracks the free objects.
+ *
+ * Each arena lists the runs of every class that have free objects, and
+ * keeps a bitmap (slab_map) with one bit per SLAB_RUN_SIZE unit of its
+ * reservation, set where a run starts. bfree checks it to tell slab
+ * objects from blocks in O(1). An empty run goes back to the heap unless
+ * it is the only run left on its class list.
+ */
+
+typedef struct slabRun {
+    heapWord next;                // links of the class's run list,
+    heapWord prev;                // as offsets like free list links
+    unsigned short obj_size;
+    unsigned short nobjs;
+    unsigned short nfree;
+    unsigned short first;         // offset of the first object
+    unsigned long long free_map[SLAB_FREE_WORDS];   // bit set => free
+} slabRun;
+
+/*
+ * Function for mapping a request size to its slab class.
+ */
+static int slab_class(size_t size) {
+    if (size < 16) {
+	    size = 16;
+    }
+    size = (size + HEAP_ALIGNMENT - 1) / HEAP_ALIGNMENT * HEAP_ALIGNMENT;
+    return (size + 7) / 8 - 2;
+}
+
+static slabRun* link_to_run(arena *a, heapWord offset) {
+    return offset ? (slabRun*)(a->base + offset) : NULL;
+}
+
+/*
+ * Function for finding the slab run an object belongs to.
+ * Returns NULL if ptr is not inside a slab run of the arena.
+ */
+static slabRun* slab_run_of(arena *a, void *ptr) {
+    if (a->slab_map == NULL || (char*)ptr < (char*)a->heap_start || (char*)ptr >= (char*)a->heap_start + load_alloc_size(a)) {
+	    return NULL;
+    }
+    unsigned long unit = ((char*)ptr - a->base) >> SLAB_RUN_SHIFT;
+    if (!(load_bits(&a->slab_map[unit / 64]) & (1ULL << (unit % 64)))) {
+	    return NULL;
+    }
+    // runs are aligned in memory, but unit numbers count from base
+    return (slabRun*)((unsigned long)ptr & ~(unsigned long)(SLAB_RUN_SIZE - 1));
+}
+
+static void slab_list_insert(arena *a, int cls, slabRun *run) {
+    slabRun *head = link_to_run(a, a->slab_runs[cls]);
+
+    run->prev = 0;
+    run->next = a->slab_runs[cls];
+    if (head != NULL) {
+	    head->prev = (char*)run - a->base;
+    }
+    a->slab_runs[cls] = (char*)run - a->base;
+}
+
+static void slab_list_remove(arena *a, int cls, slabRun *run) {
+    if (run->prev) {
+	    link_to_run(a, run->prev)->next = run->next;
+    } else {
+	    a->slab_runs[cls] = run->next;
+    }
+    if (run->next) {
+	    link_to_run(a, run->next)->prev = run->prev;
+    }
+}
+
+static void slab_map_update(arena *a, slabRun *run, int set) {
+    unsigned long unit = ((char*)run - a->base) >> SLAB_RUN_SHIFT;
+    if (set) {
+	    set_bits(&a->slab_map[unit / 64], 1ULL << (unit % 64));
+    } else {
+	    clear_bits(&a->slab_map[unit / 64], 1ULL << (unit % 64));
+    }
+}
+
+/*
+ * Function for carving a new slab run for class cls out of the heap.
+ * Returns NULL if the heap has no space for it.
+ */
+static slabRun* slab_new_run(arena *a, int cls) {
+    blockHeader *block = alloc_aligned_block(a, SLAB_RUN_SIZE, SLAB_RUN_SIZE);
+    if (block == NULL) {
+	    return NULL;
+    }
+
+    slabRun *run = (slabRun*)(block + 1);
+    run->obj_size = (cls + 2) * 8;
+    run->first = (sizeof(slabRun) + HEAP_ALIGNMENT - 1) / HEAP_ALIGNMENT * HEAP_ALIGNMENT;
+    run->nobjs = (SLAB_RUN_SIZE - run->first) / run->obj_size;
+    run->nfree = run->nobjs;
+    memset(run->free_map, 0, sizeof(run->free_map));
+    for (int i = 0; i < run->nobjs; i++) {
+	    run->free_map[i / 64] |= 1ULL << (i % 64);
+    }
+
+    slab_list_insert(a, cls, run);
+    slab_map_update(a, run, 1);
+    return run;
+}
+
+/*
+ * Function for allocating an object of slab class cls.
+ * Returns NULL if the heap has no space for a new run.
+ */
+static void* slab_alloc(arena *a, int cls) {
+    slabRun *run = link_to_run(a, a->slab_runs[cls]);
+    if (run == NULL) {
+	    run = slab_new_run(a, cls);
+	    if (run == NULL) {
+		    return NULL;
+	    }
+    }
+
+    // take the first free object, the first run on the list has one
+    int word = 0;
+    while (run->free_map[word] == 0) {
+	    word++;
+    }
+    int index = word * 64 + __builtin_ctzll(run->free_map[word]);
+    clear_bits(&run->free_map[word], 1ULL << (index % 64));
+
+    // a full run leaves the list until an object is freed
+    if (--run->nfree == 0) {
+	    slab_list_remove(a, cls, run);
+    }
+    a->stats.slab_objects++;
+    return (char*)run + run->first + index * run->obj_size;
+}
+
+/*
+ * Function for checking that ptr is an object of run that is in use.
+ * Returns the object's index or -1 if ptr is not an allocated object or
+ *   is queued to be freed, see queued_set().
+ */
+static int slab_index_of(arena *a, slabRun *run, void *ptr) {
+    int offset = (char*)ptr - (char*)run - run->first;
+    if (offset < 0 || offset % run->obj_size != 0 || offset / run->obj_size >= run->nobjs) {
+	    return -1;
+    }
+    int index = offset / run->obj_size;
+    // if object is already freed
+    if (load_bits(&run->free_map[index / 64]) & (1ULL << (index % 64)) || queued_test(a, ptr)) {
+	    return -1;
+    }
+    return index;
+}
+
+/*
+ * Function for freeing an object of a slab run.
+ * Returns 0 on success.
+ * Returns -1 if ptr is not an allocated object of the run.
+ */
+static int slab_free(arena *a, slabRun *run, void *ptr) {
+    int index = slab_index_of(a, run, ptr);
+    if (index < 0) {
+	    return -1;
+    }
+    int cls = slab_class(run->obj_size);
+
+    set_bits(&run->free_map[index / 64], 1ULL << (index % 64));
+    a->stats.slab_objects--;
+    // a full run goes back on the list
+    if (run->nfree++ == 0) {
+	    slab_list_insert(a, cls, run);
+    }
+
+    // an empty run goes back to the heap unless it is the last on its list
+    if (run->nfree == run->nobjs && (run->next || run->prev)) {
+	    slab_list_remove(a, cls, run);
+	    slab_map_update(a, run, 0);
+	    // zero the words in front of the objects, so a repeated bfree
+	    // of an object finds a free block header
+	    memset(run, 0, SLAB_RUN_SIZE);
+	    free_block(a, (blockHeader*)run - 1);
+    }
+    return 0;
+}
+
+/*
+ * Function for counting a satisfied request of 'size' bytes that got
+ * a payload of 'granted' bytes, for the padding figure of heap_report().
+ */
+static void count_request(arena *a, size_t size, size_t granted) {
+    a->stats.requested_bytes += size;
+    a->stats.padding_bytes += granted - size;
+}
+
+/*
+ * Mapped blocks.
+ *
+ * A balloc or brealloc request of at least the arena's mmap_threshold
+ * bytes, HEAP_MMAP_THRESHOLD unless changed with
+ * arena_set_mmap_threshold(), gets a mapping of its own instead of a heap
+ * block. Large buffers then never fragment the heap, and bfree gives
+ * their memory straight back to the O.S. with munmap. If the mapping
+ * fails the request is served from the heap. With HEAP_NUMA a mapping's
+ * pages come from the node of the thread that first touches them.
+ *
+ * A mapping starts with a mappedBlock, followed by a header whose
+ * size_status is 7 (a-bit, p-bit and m-bit set) and the payload. Every
+ * mapped payload is in one table shared by all arenas, so bfree checks
+ * an address outside the heap there before reading anything at it.
+ */
+#ifndef HEAP_MMAP_THRESHOLD
+#define HEAP_MMAP_THRESHOLD ((size_t)1 << 20)
+#endif
+#define MAPPED_MIN_SLOTS 64
+
+typedef struct mappedBlock {
+    arena *owner;                 // arena whose stats count the block
+    size_t length;                // bytes mapped
+} mappedBlock;
+
+/* Offset of the payload from the start of its mapping.
+ */
+#define MAPPED_OFFSET ((sizeof(mappedBlock) + sizeof(blockHeader) + HEAP_ALIGNMENT - 1) / HEAP_ALIGNMENT * HEAP_ALIGNMENT)
+
+/* Open addressing table of mapped payloads, NULL slots are empty.
+ * Guarded by its own lock, taken after an arena lock if both are held.
+ */
+static void **mapped_slots;
+static size_t mapped_mask;        // slots - 1, 0 until the first insert
+static size_t mapped_count;
+#ifdef HEAP_THREAD_SAFE
+static pthread_mutex_t mapped_table_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void mapped_lock(void) {
+#ifdef HEAP_THREAD_SAFE
+    pthread_mutex_lock(&mapped_table_lock);
+#endif
+}
+
+static void mapped_unlock(void) {
+#ifdef HEAP_THREAD_SAFE
+    pthread_mutex_unlock(&mapped_table_lock);
+#endif
+}
+
+static size_t mapped_home(void *ptr) {
+    return (size_t)(((unsigned long long)(unsigned long)ptr >> 12) * 0x9E3779B97F4A7C15ULL) & mapped_mask;
+}
+
+/*
+ * Function for finding the slot of ptr, or the empty slot it would go in.
+ * Caller must hold the mapped lock and the table must exist.
+ */
+static size_t mapped_slot(void *ptr) {
+    size_t i = mapped_home(ptr);
+    while (mapped_slots[i] != NULL && mapped_slots[i] != ptr) {
+	    i = (i + 1) & mapped_mask;
+    }
+    return i;
+}
+
+/*
+ * Function for adding a mapped payload to the table, doubling it first
+ * if it would be more than half full.
+ * Returns 0 on success.
+ * Returns -1 if the table cannot grow.
+ * Caller must hold the mapped lock.
+ */
+static int mapped_insert(void *ptr) {
+    size_t slots = mapped_mask + 1;
+    if (mapped_mask == 0 || 2 * (mapped_count + 1) > slots) {
+	    size_t newSlots = mapped_mask == 0 ? MAPPED_MIN_SLOTS : 2 * slots;
+	    void **newTable = mmap(NULL, newSlots * sizeof(void*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	    if (newTable == MAP_FAILED) {
+		    return -1;
+	    }
+	    void **oldTable = mapped_slots;
+	    mapped_slots = newTable;
+	    mapped_mask = newSlots - 1;
+	    for (size_t i = 0; oldTable != NULL && i < slots; i++) {
+		    if (oldTable[i] != NULL) {
+			    mapped_slots[mapped_slot(oldTable[i])] = oldTable[i];
+		    }
+	    }
+	    if (oldTable != NULL) {
+		    munmap(oldTable, slots * sizeof(void*));
+	    }
+    }
+    mapped_slots[mapped_slot(ptr)] = ptr;
+#ifdef HEAP_THREAD_SAFE
+    __atomic_store_n(&mapped_count, mapped_count + 1, __ATOMIC_RELAXED);
+#else
+    mapped_count++;
+#endif
+    return 0;
+}
+
+/*
+ * Function for emptying slot i, shifting back later entries of its probe
+ * sequence so that every lookup still finds them.
+ * Caller must hold the mapped lock.
+ */
+static void mapped_remove_slot(size_t i) {
+    size_t hole = i;
+    for (size_t j = (i + 1) & mapped_mask; mapped_slots[j] != NULL; j = (j + 1) & mapped_mask) {
+	    size_t home = mapped_home(mapped_slots[j]);
+	    if (((j - home) & mapped_mask) >= ((j - hole) & mapped_mask)) {
+		    mapped_slots[hole] = mapped_slots[j];
+		    hole = j;
+	    }
+    }
+    mapped_slots[hole] = NULL;
+#ifdef HEAP_THREAD_SAFE
+    __atomic_store_n(&mapped_count, mapped_count - 1, __ATOMIC_RELAXED);
+#else
+    mapped_count--;
+#endif
+}
+
+/*
+ * Function for finding the mappedBlock of a mapped payload.
+ * Returns NULL if ptr is not a mapped payload.
+ */
+static mappedBlock* mapped_lookup(void *ptr) {
+#ifdef HEAP_THREAD_SAFE
+    if (__atomic_load_n(&mapped_count, __ATOMIC_RELAXED) == 0) {
+#else
+    if (mapped_count == 0) {
+#endif
+	    return NULL;
+    }
+    mapped_lock();
+    int found = mapped_slots[mapped_slot(ptr)] == ptr;
+    mapped_unlock();
+    return found ? (mappedBlock*)((char*)ptr - MAPPED_OFFSET) : NULL;
+}
+
+/*
+ * Function for finding the mappedBlock of a mapped block of a.
+ * Returns NULL if ptr is not one.
+ * Caller must hold the arena lock.
+ */
+static mappedBlock* mapped_of(arena *a, void *ptr) {
+    if (a->stats.mapped_blocks == 0) {
+	    return NULL;
+    }
+    mappedBlock *mb = mapped_lookup(ptr);
+    if (mb == NULL || mb->owner != a || ((blockHeader*)ptr - 1)->size_status != 7) {
+	    return NULL;
+    }
+    return mb;
+}
+
+/*
+ * Function for giving a block a mapping of its own.
+ * Returns the payload address or NULL if the mapping fails.
+ * Caller has checked size and must hold the arena lock.
+ */
+static void* map_block(arena *a, size_t size) {
+    size_t pagesize = getpagesize();
+    // the usable size must fit in a heap word like a block's
+    if (size > HEAP_MAX_SIZE - MAPPED_OFFSET - pagesize) {
+	    return NULL;
+    }
+    size_t length = (MAPPED_OFFSET + size + pagesize - 1) / pagesize * pagesize;
+    mappedBlock *mb = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mb == MAP_FAILED) {
+	    return NULL;
+    }
+    void *ptr = (char*)mb + MAPPED_OFFSET;
+    mapped_lock();
+    int ret = mapped_insert(ptr);
+    mapped_unlock();
+    if (ret != 0) {
+	    munmap(mb, length);
+	    return NULL;
+    }
+    if (a->flags & HEAP_POPULATE) {
+	    populate_pages((char*)mb, length);
+    }
+
+    mb->owner = a;
+    mb->length = length;
+    ((blockHeader*)ptr - 1)->size_status = 7;
+    a->stats.mapped_blocks++;
+    a->stats.mapped_bytes += length;
+    count_request(a, size, length - MAPPED_OFFSET);
+    return ptr;
+}
+
+/*
+ * Function for unmapping a mapped block of a, see mapped_of().
+ * Returns 0 on success.
+ * Returns -1 if another thread freed it first.
+ * Caller must hold the arena lock.
+ */
+static int unmap_block(arena *a, mappedBlock *mb) {
+    void *ptr = (char*)mb + MAPPED_OFFSET;
+    mapped_lock();
+    size_t i = mapped_slot(ptr);
+    int found = mapped_slots[i] == ptr;
+    if (found) {
+	    mapped_remove_slot(i);
+    }
+    mapped_unlock();
+    if (!found) {
+	    return -1;
+    }
+    a->stats.mapped_blocks--;
+    a->stats.mapped_bytes -= mb->length;
+    munmap(mb, mb->length);
+    return 0;
+}
+
+/*
+ * Function for unmapping every mapped block of a, for arena_destroy().
+ */
+static void unmap_all(arena *a) {
+    mapped_lock();
+    for (size_t i = 0; mapped_mask != 0 && i <= mapped_mask; ) {
+	    mappedBlock *mb = mapped_slots[i] ? (mappedBlock*)((char*)mapped_slots[i] - MAPPED_OFFSET) : NULL;
+	    if (mb != NULL && mb->owner == a) {
+		    // the removal can shift another block into slot i
+		    mapped_remove_slot(i);
+		    munmap(mb, mb->length);
+	    } else {
+		    i++;
+	    }
+    }
+    mapped_unlock();
+}
+
+/*
+ * Function for allocating a heap block for 'size' bytes, never a slab
+ * object. Caller has checked size.
+ * Returns the payload address or NULL if there is no space.
+ */
+static void* alloc_block(arena *a, size_t size) {
+    size_t blockSize = block_size_for(size);
+
+    blockHeader *bestFit = take_best_fit(a, blockSize);
+    // cannot find best-fit block
+    if (bestFit == NULL) {
+	    a->stats.failed_allocs++;
+	    return NULL;
+    }
+    place_block(a, bestFit, bestFit->size_status & ~3, blockSize);
+    canary_set(bestFit, size);
+    count_request(a, size, blockSize - sizeof(blockHeader));
+
+    return bestFit + 1;
+}
+
+/* 
+ * Function for allocating 'size' bytes of heap memory.
+ * Argument size: requested size for the payload
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure.
+ *
+ * This function must:
+ * - Check size - Return NULL if size < 1 
+ * - Return NULL if size is above HEAP_MAX_SIZE
+ * - Serve sizes up to SLAB_MAX from a slab run if possible
+ * - Determine block size rounding up to a multiple of 8 
+ *   and possibly adding padding as a result.
+ *
+ * - Use BEST-FIT PLACEMENT POLICY to chose a free block
+ *
+ * - If the BEST-FIT block that is found is exact size match
+ *   - 1. Update all heap blocks as needed for any affected blocks
+ *   - 2. Return the address of the allocated block payload
+ *
+ * - If the BEST-FIT block that is found is large enough to split 
+ *   - 1. SPLIT the free block into two valid heap blocks:
+ *         1. an allocated block
+ *         2. a free block
+ *         NOTE: both blocks must meet heap block requirements 
+ *       - Update all heap block header(s) and footer(s) 
+ *              as needed for any affected blocks.
+ *   - 2. Return the address of the allocated block payload
+ *
+ *   Return if NULL unable to find and allocate block for required size
+ *   even after growing the heap
+ *
+ * Payload address that is returned is NOT the address of the
+ *       block header.  It is the address of the start of the 
+ *       available memory for the requesterr.
+ *
+ * Argument a: the arena to allocate from.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static void* heap_balloc(arena *a, size_t size) {
+    if (size < 1 || size > HEAP_MAX_SIZE) {
+	    return NULL;
+    }
+
+    // small requests are objects in a slab run
+    if (size <= SLAB_MAX && a->slab_map != NULL) {
+	    void *ptr = slab_alloc(a, slab_class(size));
+	    if (ptr != NULL) {
+		    count_request(a, size, (slab_class(size) + 2) * 8);
+		    return ptr;
+	    }
+    }
+
+    // large requests get a mapping of their own
+    if (a->mmap_threshold != 0 && size >= a->mmap_threshold) {
+	    void *ptr = map_block(a, size);
+	    if (ptr != NULL) {
+		    return ptr;
+	    }
+    }
+
+    return alloc_block(a, size);
+} 
+
+/*
+ * Function for allocating 'size' bytes at an address that is a multiple
+ * of align. The padding in front of the block is split off as a free
+ * block, so the result is an ordinary block that bfree takes back.
+ * Argument align: a power of two. Up to 8 any block is aligned.
+ * Returns NULL if size < 1, align is not a power of two or there is
+ * no space.
+ *
+ * Argument a: the arena to allocate from.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static void* heap_balloc_aligned(arena *a, size_t size, size_t align) {
+    if (align == 0 || (align & (align - 1)) != 0 || align > HEAP_MAX_SIZE) {
+	    return NULL;
+    }
+    if (align <= 8) {
+	    return heap_balloc(a, size);
+    }
+    if (size < 1 || size > HEAP_MAX_SIZE) {
+	    return NULL;
+    }
+
+    blockHeader *block = alloc_aligned_block(a, size, align);
+    if (block == NULL) {
+	    a->stats.failed_allocs++;
+	    return NULL;
+    }
+    canary_set(block, size);
+    count_request(a, size, block_size_for(size) - sizeof(blockHeader));
+    return block + 1;
+}
+
+/*
+ * Function for zeroing the first size bytes of a payload that
+ * heap_balloc() just returned, skipping the pages known to be zero.
+ *
+ * The region is mapped from /dev/zero and trimmed pages read as zero, so
+ * everything from trim_off up is zero except the footer of the top free
+ * block and the end mark, which share the heap's last page. Only the parts
+ * of the payload outside of that range are cleared. A heap_grow() during
+ * the allocation moves trim_off to the old end of the region, from where
+ * the new pages count instead. Mapped blocks are fresh mappings and are
+ * not cleared at all.
+ * Argument trimOff, mapSize: trim_off and map_size before the allocation.
+ * Caller must hold the arena lock.
+ */
+static void zero_payload(arena *a, char *ptr, size_t size, size_t trimOff, size_t mapSize) {
+    if (mapped_of(a, ptr) != NULL) {
+	    return;
+    }
+    size_t zeroOff = a->map_size != mapSize ? mapSize : trimOff;
+    if (zeroOff == 0 || slab_run_of(a, ptr) != NULL) {
+	    memset(ptr, 0, size);
+	    return;
+    }
+
+    char *lo = a->base + zeroOff;
+    char *footer = (char*)a->heap_start + a->alloc_size - sizeof(blockHeader);
+    char *hi = (char*)((unsigned long)footer & ~(unsigned long)(getpagesize() - 1));
+    char *end = ptr + size;
+    if (ptr < lo) {
+	    memset(ptr, 0, (end < lo ? end : lo) - ptr);
+    }
+    if (end > hi) {
+	    char *from = ptr > hi ? ptr : hi;
+	    memset(from, 0, end - from);
+    }
+}
+
+/*
+ * Function for allocating a zeroed array of n elements of 'size' bytes,
+ * like calloc. Memory that is known to be zero is not cleared again,
+ * see zero_payload(), so large requests from fresh or trimmed pages cost
+ * no more than balloc.
+ * Returns NULL if n * size is 0, overflows or there is no space.
+ *
+ * Argument a: the arena to allocate from.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static void* heap_bcalloc(arena *a, size_t n, size_t size) {
+    if (size != 0 && n > HEAP_MAX_SIZE / size) {
+	    return NULL;
+    }
+    size_t trimOff = a->trim_off;
+    size_t mapSize = a->map_size;
+    void *ptr = heap_balloc(a, n * size);
+    if (ptr != NULL) {
+	    zero_payload(a, ptr, n * size, trimOff, mapSize);
+    }
+    return ptr;
+}
+ 
+/* 
+ * Function for freeing up a previously allocated block.
+ * Argument ptr: address of the block to be freed up.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ * This function:
+ * - Return -1 if ptr is NULL.
+ * - Return -1 if ptr is not a multiple of HEAP_ALIGNMENT.
+ * - Return -1 if ptr is outside of the heap space.
+ * - Return -1 if ptr block is already freed.
+ * - Return -1 if ptr is not the start of a block's payload, e.g. points
+ *   into the middle of a block, see block_map_set().
+ * - Return -1 if the block's canary is overwritten, see HEAP_DEBUG.
+ * - Return objects of slab runs to their run.
+ * - Update header(s) and footer as needed.
+ * - Coalesce with the next and previous blocks if they are free.
+ *   The p-bit and the free block footers make both merges O(1),
+ *   so adjacent free blocks never exist after bfree returns.
+ * - Give the pages of a large free block at the end of the heap back.
+ *
+ * Argument a: the arena ptr was allocated from.
+ * In thread-safe mode the caller must hold the arena lock.
+ */                    
+static int heap_bfree(arena *a, void *ptr) {
+    slabRun *run = slab_run_of(a, ptr);
+    if (run != NULL) {
+	    return slab_free(a, run, ptr);
+    }
+
+    blockHeader *block = ptr_to_block(a, ptr);
+    if (block == NULL) {
+	    mappedBlock *mb = mapped_of(a, ptr);
+	    return mb != NULL ? unmap_block(a, mb) : -1;
+    }
+    // an overflowed block stays allocated, its neighbor may be damaged
+    if (payload_size(block) == 0) {
+	    heap_error("Error:mem.c: Canary of the block at %p is overwritten\n", ptr);
+	    return -1;
+    }
+    free_block(a, block);
+
+    // freed the block
+    return 0;
+} 
+
+/*
+ * Function for changing the size of a previously allocated block.
+ * Argument ptr: address returned by balloc, or NULL to just allocate.
+ * Argument size: the new payload size.
+ * Returns the address of the resized block on success, which is ptr
+ *   unless the block had to move. The payload is kept up to the smaller
+ *   of the old and new size.
+ * Returns NULL on failure, leaving the old block allocated and unchanged.
+ * This function:
+ * - Return NULL if size < 1 or ptr is not an allocated block.
+ * - Return NULL if the block's canary is overwritten, see HEAP_DEBUG.
+ * - Keep slab objects in place if size still fits the object.
+ * - Shrink a block in place, splitting the tail off as a free block.
+ * - Grow a block in place by absorbing the next block if it is free,
+ *   growing the heap first if the block is the last one.
+ * - Otherwise allocate a new block, copy the payload and free ptr.
+ *
+ * Argument a: the arena ptr was allocated from.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static void* heap_brealloc(arena *a, void *ptr, size_t size) {
+    if (ptr == NULL) {
+	    return heap_balloc(a, size);
+    }
+    if (size < 1 || size > HEAP_MAX_SIZE) {
+	    return NULL;
+    }
+
+    size_t oldSize; // payload bytes at ptr, see payload_size()
+    slabRun *run = slab_run_of(a, ptr);
+    blockHeader *block = NULL;
+    if (run != NULL) {
+	    if (slab_index_of(a, run, ptr) < 0) {
+		    return NULL;
+	    }
+	    oldSize = run->obj_size;
+	    if (size <= oldSize) {
+		    return ptr;
+	    }
+    } else {
+	    block = ptr_to_block(a, ptr);
+	    if (block == NULL) {
+		    mappedBlock *mb = mapped_of(a, ptr);
+		    if (mb == NULL) {
+			    return NULL;
+		    }
+		    // a mapped block keeps its mapping while it stays large
+		    oldSize = mb->length - MAPPED_OFFSET;
+		    if (size <= oldSize && a->mmap_threshold != 0 && size >= a->mmap_threshold) {
+			    return ptr;
+		    }
+		    void *newPtr = heap_balloc(a, size);
+		    if (newPtr == NULL) {
+			    return NULL;
+		    }
+		    memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+		    unmap_block(a, mb);
+		    return newPtr;
+	    }
+	    oldSize = payload_size(block);
+	    if (oldSize == 0) {
+		    heap_error("Error:mem.c: Canary of the block at %p is overwritten\n", ptr);
+		    return NULL;
+	    }
+    }
+
+    if (block != NULL) {
+	    size_t blockSize = block_size_for(size);
+	    size_t currentSize = block->size_status & ~3;
+	    blockHeader *nextBlock = (blockHeader*)((char*)block + currentSize);
+
+	    // the last block can grow with the heap
+	    if (blockSize > currentSize && (is_end_mark(nextBlock) ||
+			    (!(nextBlock->size_status & 1) && is_end_mark((blockHeader*)((char*)nextBlock + (nextBlock->size_status & ~3)))))) {
+		    size_t nextSize = is_end_mark(nextBlock) ? 0 : nextBlock->size_status & ~3;
+		    if (currentSize + nextSize < blockSize) {
+			    heap_grow(a, blockSize - currentSize);
+		    }
+	    }
+
+	    // if next block is free and big enough absorb it, the end mark is never free
+	    if (blockSize > currentSize && !(nextBlock->size_status & 1) &&
+			    currentSize + (nextBlock->size_status & ~3) >= blockSize) {
+		    free_list_remove(a, nextBlock);
+		    merge_cursor(a, nextBlock, block);
+		    a->stats.merges++;
+		    // split off what is not needed like balloc does, the block
+		    // never covers the whole next block on its own
+		    place_block(a, block, currentSize + (nextBlock->size_status & ~3), blockSize);
+		    canary_set(block, size);
+		    return ptr;
+	    }
+
+	    if (blockSize <= currentSize) {
+		    // if the tail is large enough to be a block of its own
+		    if (currentSize - blockSize >= MIN_BLOCK_SIZE) {
+			    // the tail is freed like an allocated block, which merges
+			    // it with the next block if that is free
+			    blockHeader *tail = (blockHeader*)((char*)block + blockSize);
+			    tail->size_status = (currentSize - blockSize) | 3;
+			    publish_header(block, blockSize | (block->size_status & 3));
+			    a->stats.splits++;
+			    free_block(a, tail);
+		    }
+		    canary_set(block, size);
+		    return ptr;
+	    }
+    }
+
+    // cannot resize in place, move the payload, heap_balloc counts a failure
+    void *newPtr = heap_balloc(a, size);
+    if (newPtr == NULL) {
+	    return NULL;
+    }
+    memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+    heap_bfree(a, ptr);
+    return newPtr;
+}
+
+/*
+ * Function for allocating count blocks of 'size' bytes each.
+ * Argument out: filled with the payload addresses.
+ * Returns the number of blocks allocated, less than count only if the
+ *   heap ran out of space.
+ *
+ * Small sizes are slab objects. Larger blocks are carved back to back
+ * from one best-fit free block that holds all of them, so the free lists
+ * are searched once per batch instead of once per block. If no free
+ * block is that large, each free block that holds at least one is filled
+ * with as many as fit, and the heap only grows for the blocks the free
+ * blocks cannot hold.
+ *
+ * Argument a: the arena to allocate from.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static size_t heap_balloc_batch(arena *a, size_t size, size_t count, void **out) {
+    size_t n = 0;
+
+    // the free lists of a corrupt heap are not searched, see take_best_fit()
+    if (size < 1 || size > HEAP_MAX_SIZE || a->corrupt) {
+	    return 0;
+    }
+
+    if (size <= SLAB_MAX && a->slab_map != NULL) {
+	    while (n < count && (out[n] = slab_alloc(a, slab_class(size))) != NULL) {
+		    count_request(a, size, (slab_class(size) + 2) * 8);
+		    n++;
+	    }
+	    if (n == count) {
+		    return n;
+	    }
+    }
+
+    size_t blockSize = block_size_for(size);
+    while (n < count) {
+	    size_t want = count - n;
+	    if (want > HEAP_MAX_SIZE / blockSize) {
+		    want = HEAP_MAX_SIZE / blockSize;
+	    }
+	    // free blocks are used up before the heap grows, as by balloc
+	    blockHeader *region = find_fit(a, want * blockSize);
+	    if (region == NULL) {
+		    region = find_fit(a, blockSize);
+	    }
+	    if (region != NULL) {
+		    free_list_remove(a, region);
+	    } else {
+		    region = take_best_fit(a, want * blockSize);
+		    if (region == NULL) {
+			    region = take_best_fit(a, blockSize);
+		    }
+		    if (region == NULL) {
+			    a->stats.failed_allocs++;
+			    break;
+		    }
+	    }
+
+	    size_t regionSize = region->size_status & ~3;
+	    size_t blocks = regionSize / blockSize;
+	    if (blocks > count - n) {
+		    blocks = count - n;
+	    }
+
+	    // every block but the last is allocated directly, the last one
+	    // takes the rest of the region and is split like in balloc
+	    blockHeader *block = region;
+	    heapWord pbit = region->size_status & 2;
+	    for (size_t i = 0; i < blocks; i++) {
+		    out[n++] = block + 1;
+		    count_request(a, size, blockSize - sizeof(blockHeader));
+		    if (i == blocks - 1) {
+			    place_block(a, block, regionSize, blockSize);
+			    canary_set(block, size);
+		    } else {
+			    // the rest of the region stays one free block
+			    ((blockHeader*)((char*)block + blockSize))->size_status = (regionSize - blockSize) | 2;
+			    publish_header(block, blockSize | pbit | 1);
+			    block_map_set(a, block);
+			    canary_set(block, size);
+			    pbit = 2;
+			    a->stats.splits++;
+			    regionSize -= blockSize;
+			    block = (blockHeader*)((char*)block + blockSize);
+		    }
+	    }
+    }
+    return n;
+}
+
+/*
+ * Function for ordering pointers by address for heap_bfree_batch().
+ */
+static int compare_ptrs(const void *p1, const void *p2) {
+    char *ptr1 = *(char* const*)p1;
+    char *ptr2 = *(char* const*)p2;
+    return ptr1 < ptr2 ? -1 : ptr1 > ptr2;
+}
+
+/*
+ * Function for freeing n blocks at once.
+ * Argument ptrs: the blocks to free, sorted by address in place.
+ * Returns 0 if every block was freed.
+ * Returns -1 if any pointer failed the bfree checks; all other blocks
+ *   are still freed.
+ *
+ * After sorting, blocks that are next to each other in the heap are
+ * joined into one free block first, so each run of neighbors is merged
+ * with the surrounding free blocks and put on a free list only once.
+ *
+ * Argument a: the arena the blocks were allocated from.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static int heap_bfree_batch(arena *a, void **ptrs, size_t n) {
+    int ret = 0;
+
+    qsort(ptrs, n, sizeof(void*), compare_ptrs);
+
+    size_t i = 0;
+    while (i < n) {
+	    slabRun *run = slab_run_of(a, ptrs[i]);
+	    if (run != NULL) {
+		    if (slab_free(a, run, ptrs[i]) != 0) {
+			    ret = -1;
+		    }
+		    i++;
+		    continue;
+	    }
+
+	    blockHeader *block = ptr_to_block(a, ptrs[i++]);
+	    if (block == NULL) {
+		    mappedBlock *mb = mapped_of(a, ptrs[i - 1]);
+		    if (mb == NULL || unmap_block(a, mb) != 0) {
+			    ret = -1;
+		    }
+		    continue;
+	    }
+	    if (payload_size(block) == 0) {
+		    heap_error("Error:mem.c: Canary of the block at %p is overwritten\n", ptrs[i - 1]);
+		    ret = -1;
+		    continue;
+	    }
+
+	    // absorb the following blocks of the batch that are its neighbors
+	    size_t blockSize = block->size_status & ~3;
+	    while (i < n && (char*)ptrs[i] == (char*)block + blockSize + sizeof(blockHeader)) {
+		    blockHeader *nextBlock = slab_run_of(a, ptrs[i]) ? NULL : ptr_to_block(a, ptrs[i]);
+		    // a block with an overwritten canary is reported on its own
+		    if (nextBlock == NULL || payload_size(nextBlock) == 0) {
+			    break;
+		    }
+		    // the absorbed header stays marked free, see free_block()
+		    nextBlock->size_status &= ~1;
+		    block_map_clear(a, nextBlock);
+		    merge_cursor(a, nextBlock, block);
+		    a->stats.merges++;
+		    blockSize += nextBlock->size_status & ~3;
+		    i++;
+	    }
+	    publish_header(block, blockSize | (block->size_status & 3));
+	    free_block(a, block);
+    }
+    return ret;
+}
+
+/*
+ * Handles.
+ *
+ * A block allocated through a handle may be moved by heap_compact()
+ * whenever it is not pinned, so its address is only valid between
+ * heap_handle_pin() and heap_handle_unpin(). A handle is the index + 1 of
+ * its entry in the arena's handle table, which is mapped apart from the
+ * heap and grows by doubling; 0 is never a valid handle. Freed entries are
+ * chained through next_free and reused.
+ */
+#define HANDLE_MIN_SLOTS 1024
+
+typedef struct handleEntry {
+    size_t block;                 // block offset from base, 0 if free
+    unsigned int pins;
+    size_t next_free;             // next free entry, index + 1
+} handleEntry;
+
+/*
+ * Function for finding the entry of a live handle.
+ * Returns NULL if h is not a live handle of a.
+ */
+static handleEntry* handle_entry(arena *a, heapHandle h) {
+    if (h == 0 || h > a->handles_used || a->handles[h - 1].block == 0) {
+	    return NULL;
+    }
+    return &a->handles[h - 1];
+}
+
+/*
+ * Function for taking a free handle table entry, doubling the table if
+ * every entry is used.
+ * Returns the entry's handle or 0 if the table cannot grow.
+ */
+static heapHandle handle_new(arena *a) {
+    if (a->free_handle != 0) {
+	    heapHandle h = a->free_handle;
+	    a->free_handle = a->handles[h - 1].next_free;
+	    return h;
+    }
+    // the table of a shared heap would be private to one process
+    if (a->handles_used == a->handle_slots && (a->flags & HEAP_SHARED)) {
+	    return 0;
+    }
+    if (a->handles_used == a->handle_slots) {
+	    size_t slots = a->handle_slots != 0 ? 2 * a->handle_slots : HANDLE_MIN_SLOTS;
+	    handleEntry *handles = mmap(NULL, slots * sizeof(handleEntry), PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	    if (handles == MAP_FAILED) {
+		    return 0;
+	    }
+	    if (a->handles != NULL) {
+		    memcpy(handles, a->handles, a->handle_slots * sizeof(handleEntry));
+		    munmap(a->handles, a->handle_slots * sizeof(handleEntry));
+	    }
+	    a->handles = handles;
+	    a->handle_slots = slots;
+    }
+    return ++a->handles_used;
+}
+
+/*
+ * Function for allocating a movable block of 'size' bytes.
+ * Returns the block's handle, 0 if size < 1 or there is no space.
+ * Handle blocks are always heap blocks, never slab objects, so that
+ * heap_compact() can move them.
+ *
+ * Argument a: the arena to allocate from.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static heapHandle heap_balloc_handle(arena *a, size_t size) {
+    if (size < 1 || size > HEAP_MAX_SIZE) {
+	    return 0;
+    }
+    heapHandle h = handle_new(a);
+    if (h == 0) {
+	    return 0;
+    }
+    char *ptr = alloc_block(a, size);
+    if (ptr == NULL) {
+	    a->handles[h - 1].block = 0;
+	    a->handles[h - 1].next_free = a->free_handle;
+	    a->free_handle = h;
+	    return 0;
+    }
+    a->handles[h - 1].block = ptr - sizeof(blockHeader) - a->base;
+    a->handles[h - 1].pins = 0;
+    return h;
+}
+
+/*
+ * Function for freeing the block of a handle and the handle itself.
+ * Returns 0 on success.
+ * Returns -1 if h is not a live handle or is pinned, or if its block's
+ *   canary is overwritten, see HEAP_DEBUG.
+ *
+ * Argument a: the arena h was allocated from.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static int heap_bfree_handle(arena *a, heapHandle h) {
+    handleEntry *entry = handle_entry(a, h);
+    if (a->corrupt || entry == NULL || entry->pins != 0) {
+	    return -1;
+    }
+    if (payload_size((blockHeader*)(a->base + entry->block)) == 0) {
+	    heap_error("Error:mem.c: Canary of the block of handle %zu is overwritten\n", h);
+	    return -1;
+    }
+    free_block(a, (blockHeader*)(a->base + entry->block));
+    entry->block = 0;
+    entry->next_free = a->free_handle;
+    a->free_handle = h;
+    return 0;
+}
+
+/*
+ * Function for pinning the block of a handle in place. Pins nest, each
+ * heap_handle_pin() needs its own heap_handle_unpin().
+ * Returns the block's payload address, valid until the last unpin.
+ * Returns NULL if h is not a live handle.
+ *
+ * Argument a: the arena h was allocated from.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static void* heap_handle_pin(arena *a, heapHandle h) {
+    handleEntry *entry = handle_entry(a, h);
+    if (entry == NULL) {
+	    return NULL;
+    }
+    entry->pins++;
+    return a->base + entry->block + sizeof(blockHeader);
+}
+
+/*
+ * Function for releasing one pin of a handle.
+ * Returns 0 on success.
+ * Returns -1 if h is not a live handle or is not pinned.
+ *
+ * Argument a: the arena h was allocated from.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static int heap_handle_unpin(arena *a, heapHandle h) {
+    handleEntry *entry = handle_entry(a, h);
+    if (entry == NULL || entry->pins == 0) {
+	    return -1;
+    }
+    entry->pins--;
+    return 0;
+}
+
+/*
+ * Function for ordering handle table entries by block address for
+ * heap_compact().
+ */
+static int compare_handles(const void *p1, const void *p2) {
+    size_t block1 = (*(handleEntry* const*)p1)->block;
+    size_t block2 = (*(handleEntry* const*)p2)->block;
+    return block1 < block2 ? -1 : block1 > block2;
+}
+
+/*
+ * Function for sliding every unpinned handle block toward heap_start.
+ * Returns the size of the free block left at the end of the heap, whose
+ *   pages are given back to the O.S., or 0 if there is none.
+ * Returns 0 as well if the handle blocks cannot be sorted, leaving the
+ *   heap as it was.
+ *
+ * Blocks are visited in address order with a destination that starts at
+ * heap_start:
+ * - A free block is skipped, its space joins the gap before the next
+ *   block that stays.
+ * - An unpinned handle block is moved down to the destination and its
+ *   handle updated.
+ * - Any other allocated block stays where it is, the gap in front of it
+ *   becomes one free block and the destination jumps past it.
+ * All free lists are rebuilt from the gaps. Slab runs, blocks from
+ * balloc and pinned handle blocks never move.
+ *
+ * Argument a: the arena to compact.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static size_t heap_compact(arena *a) {
+    if (a->corrupt) {
+	    return 0;
+    }
+    size_t movable = 0;
+    for (size_t i = 0; i < a->handles_used; i++) {
+	    if (a->handles[i].block != 0 && a->handles[i].pins == 0) {
+		    movable++;
+	    }
+    }
+
+    // the unpinned handles sorted by address, so the heap walk can tell
+    // which blocks may move
+    handleEntry **order = NULL;
+    if (movable > 0) {
+	    order = mmap(NULL, movable * sizeof(handleEntry*), PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	    if (order == MAP_FAILED) {
+		    return 0;
+	    }
+	    for (size_t i = 0, n = 0; i < a->handles_used; i++) {
+		    if (a->handles[i].block != 0 && a->handles[i].pins == 0) {
+			    order[n++] = &a->handles[i];
+		    }
+	    }
+	    qsort(order, movable, sizeof(handleEntry*), compare_handles);
+    }
+
+    // every free block goes, the gaps left after moving are the new ones;
+    // a free block that disappears counts as a merge, see heap_read_stats()
+    size_t oldFreeBlocks = a->stats.free_blocks;
+    memset(a->free_lists, 0, sizeof(a->free_lists));
+    a->free_list_map = 0;
+    a->stats.free_blocks = 0;
+    a->stats.bytes_free = 0;
+    a->coalesce_next = NULL;
+    a->rover = NULL;
+
+    size_t next = 0;
+    char *dest = (char*)a->heap_start;
+    blockHeader *current = a->heap_start;
+    while (!is_end_mark(current)) {
+	    size_t size = current->size_status & ~3;
+	    blockHeader *following = (blockHeader*)((char*)current + size);
+
+	    if (!(current->size_status & 1)) {
+		    // free, leave it to the gap
+	    } else if (next < movable && a->base + order[next]->block == (char*)current) {
+		    blockHeader *moved = (blockHeader*)dest;
+		    if (moved != current) {
+			    block_map_clear(a, current);
+			    memmove(moved, current, size);
+			    block_map_set(a, moved);
+			    order[next]->block = dest - a->base;
+		    }
+		    // the block before the destination is always allocated
+		    moved->size_status = size | 3;
+		    dest += size;
+		    next++;
+	    } else {
+		    if (dest != (char*)current) {
+			    blockHeader *gap = (blockHeader*)dest;
+			    gap->size_status = ((char*)current - dest) | 2;
+			    set_footer(gap, (char*)current - dest);
+			    free_list_insert(a, gap);
+			    clear_pbit(current);
+		    } else {
+			    set_pbit(current);
+		    }
+		    dest = (char*)following;
+	    }
+	    current = following;
+    }
+
+    size_t topSize = (char*)current - dest;
+    if (topSize > 0) {
+	    blockHeader *top = (blockHeader*)dest;
+	    top->size_status = topSize | 2;
+	    set_footer(top, topSize);
+	    free_list_insert(a, top);
+	    clear_pbit(current);
+	    heap_trim(a, top);
+    } else {
+	    set_pbit(current);
+    }
+    a->stats.merges += oldFreeBlocks - a->stats.free_blocks;
+
+    if (order != NULL) {
+	    munmap(order, movable * sizeof(handleEntry*));
+    }
+    return topSize;
+}
+
+/*
+ * Remote free queue, thread-safe mode only.
+ *
+ * A created arena is owned by the thread that made it, see
+ * arena_set_owner(). A free of one of its blocks from any other thread
+ * does not take the arena lock: remote_push() puts the block on a
+ * lock-free stack, and the next allocation, statistics or coalesce call
+ * takes the whole stack with one exchange and frees it under the lock as
+ * one batch. Headers and p-bits are still only changed under the lock,
+ * and the owner's allocations do not wait behind other threads' frees.
+ */
+#define REMOTE_BATCH 64
+
+/*
+ * Function for queueing ptr to be freed by the arena's owner.
+ * ptr is checked like bfree checks it, reading the headers and bitmaps
+ * atomically, and marked as queued before it is linked: a heap block or
+ * slab object gets its queued bit, a mapped block's header loses its
+ * p-bit. A second free of ptr from any thread then fails instead of
+ * linking the block twice or writing into a free block.
+ * Without queued bits ptr is freed under the arena lock instead.
+ * Returns 0 on success.
+ * Returns -1 if ptr is not an allocated block of a or is already queued.
+ */
+#ifdef HEAP_THREAD_SAFE
+static int remote_push(arena *a, void *ptr) {
+    char *start = (char*)a->heap_start;
+    if ((size_t)ptr % HEAP_ALIGNMENT != 0) {
+	    return -1;
+    }
+    if ((char*)ptr <= start || (char*)ptr >= start + load_alloc_size(a)) {
+	    mappedBlock *mb = mapped_lookup(ptr);
+	    heapWord header = 7;
+	    if (mb == NULL || mb->owner != a || !__atomic_compare_exchange_n(&((blockHeader*)ptr - 1)->size_status,
+			    &header, 5, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		    return -1;
+	    }
+    } else if (a->queued_map == NULL) {
+	    arena_lock(a);
+	    int ret = heap_bfree(a, ptr);
+	    arena_unlock(a);
+	    return ret;
+    } else {
+	    slabRun *run = slab_run_of(a, ptr);
+	    blockHeader *block = (blockHeader*)ptr - 1;
+	    if (run != NULL ? slab_index_of(a, run, ptr) < 0 :
+			    !(load_header(block) & 1) || !block_map_test(a, block)) {
+		    return -1;
+	    }
+	    // the thread that sets the bit is the one that queues ptr
+	    if (queued_set(a, ptr) != 0) {
+		    return -1;
+	    }
+    }
+
+    void *head = __atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED);
+    do {
+	    *(void**)ptr = head;
+    } while (!__atomic_compare_exchange_n(&a->remote_frees, &head, ptr, 1,
+		    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/*
+ * Function for telling whether the calling thread must free blocks of a
+ * through its remote free queue.
+ */
+static int is_remote(arena *a) {
+    return a->has_owner && !pthread_equal(a->owner, pthread_self());
+}
+#endif
+
+/*
+ * Function for freeing every block on the remote free queue of a.
+ * Caller must hold the arena lock.
+ */
+static void remote_drain(arena *a) {
+#ifdef HEAP_THREAD_SAFE
+    if (__atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED) == NULL) {
+	    return;
+    }
+    void *list = __atomic_exchange_n(&a->remote_frees, NULL, __ATOMIC_ACQUIRE);
+
+    void *batch[REMOTE_BATCH];
+    size_t n = 0;
+    char *start = (char*)a->heap_start;
+    while (list != NULL) {
+	    // the link is overwritten once the block is freed
+	    void *next = *(void**)list;
+	    // off the queue, bfree takes the block again
+	    if ((char*)list <= start || (char*)list >= start + a->alloc_size) {
+		    __atomic_store_n(&((blockHeader*)list - 1)->size_status, 7, __ATOMIC_RELAXED);
+	    } else {
+		    queued_clear(a, list);
+	    }
+	    batch[n++] = list;
+	    if (n == REMOTE_BATCH) {
+		    heap_bfree_batch(a, batch, n);
+		    n = 0;
+	    }
+	    list = next;
+    }
+    if (n > 0) {
+	    heap_bfree_batch(a, batch, n);
+    }
+#else
+    (void)a;
+#endif
+}
+
+/*
+ * NUMA nodes, see init_heap_flags().
+ *
+ * With HEAP_NUMA the default arena is node 0's and every other node gets
+ * an arena of its own whose pages are placed on that node, see
+ * bind_region(). balloc allocates from the arena of the node the calling
+ * thread runs on and falls back to the other nodes' arenas in turn when
+ * that one has no space. bfree and brealloc find a block's arena by its
+ * address, and brealloc moves a block to another node's arena when its
+ * own has no space for it. Handles, coalesce_step(), heap_report() and disp_heap() stay
+ * with node 0's arena.
+ *
+ * A thread's node is looked up with getcpu() on its first call and again
+ * every NUMA_RECHECK calls, so a thread moved to another node follows
+ * after a while. In thread-safe mode its cache stays with the first node.
+ */
+#ifndef HEAP_MAX_NODES
+#define HEAP_MAX_NODES 64
+#endif
+#define NUMA_RECHECK 1024
+
+/* Arena of each node, NULL for nodes whose arena could not be created.
+ * Set up by init_heap_flags() before other threads use the heap.
+ */
+static arena *node_arenas[HEAP_MAX_NODES] = { &default_arena };
+static int num_nodes = 1;
+
+static __thread int thread_node = -1;
+static __thread unsigned int thread_node_calls;
+
+/*
+ * Function for finding the node the calling thread runs on.
+ * Returns an index into node_arenas of an arena that exists, 0 if the
+ * node is not known.
+ */
+static int local_node(void) {
+    if (num_nodes == 1) {
+	    return 0;
+    }
+    if (thread_node < 0 || ++thread_node_calls % NUMA_RECHECK == 0) {
+	    unsigned int cpu, node;
+	    thread_node = 0;
+#ifdef SYS_getcpu
+	    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 &&
+			    node < (unsigned int)num_nodes && node_arenas[node] != NULL) {
+		    thread_node = node;
+	    }
+#endif
+    }
+    return thread_node;
+}
+
+/*
+ * Function for finding the node arena whose region holds ptr, or that
+ * owns it if it is a mapped block.
+ * Returns NULL if no node arena does.
+ */
+static arena* arena_holding(void *ptr) {
+    for (int i = 0; i < num_nodes; i++) {
+	    arena *a = node_arenas[i];
+	    if (a != NULL && a->base != NULL && (char*)ptr >= a->base && (char*)ptr < a->base + a->reserve_size) {
+		    return a;
+	    }
+    }
+    mappedBlock *mb = mapped_lookup(ptr);
+    return mb != NULL ? mb->owner : NULL;
+}
+
+/*
+ * Function for finding the node arena of ptr, see arena_holding().
+ * Returns the default arena if no other one holds it.
+ */
+static arena* arena_of(void *ptr) {
+    arena *a = arena_holding(ptr);
+    return a != NULL ? a : &default_arena;
+}
+
+#ifdef HEAP_THREAD_SAFE
+/*
+ * Thread cache, thread-safe mode only.
+ *
+ * Each thread keeps up to TCACHE_COUNT slab objects per slab class.
+ * Cached objects stay marked allocated in their runs, so no other thread
+ * touches them and balloc/bfree can hand them out and take them back
+ * without an arena lock. The lock is only taken when an
+ * empty bin is refilled from the slab runs or a full bin is drained back
+ * to them, TCACHE_BATCH objects at a time.
+ *
+ * A cached object holds the link to the next object in its bin and the
+ * key of the owning cache. The key lets bfree notice an object that is
+ * already in its cache without searching every bin.
+ */
+#define TCACHE_COUNT 32
+#define TCACHE_BATCH 16
+
+typedef struct tcacheEntry {
+    struct tcacheEntry *next;
+    unsigned int key;
+} tcacheEntry;
+
+typedef struct threadCache {
+    tcacheEntry *bins[NUM_SLAB_CLASSES];
+    int counts[NUM_SLAB_CLASSES];
+    int registered;
+    arena *home;        // arena the cached objects belong to, see
+					    // tcache_register()
+} threadCache;
+
+static __thread threadCache thread_cache;
+
+/* Used only to drain a thread's cache when the thread exits.
+ */
+static pthread_key_t tcache_exit_key;
+static pthread_once_t tcache_exit_once = PTHREAD_ONCE_INIT;
+
+static unsigned int tcache_key_of(threadCache *tc) {
+    return (unsigned int)(unsigned long)tc;
+}
+
+/*
+ * Function for returning up to n objects of bin cls to their runs.
+ * Caller must hold the lock of tc's arena.
+ */
+static void tcache_drain(threadCache *tc, int cls, int n) {
+    while (n-- > 0 && tc->bins[cls] != NULL) {
+	    tcacheEntry *entry = tc->bins[cls];
+	    tc->bins[cls] = entry->next;
+	    tc->counts[cls]--;
+	    heap_bfree(tc->home, entry);
+    }
+}
+
+/*
+ * Thread exit destructor, gives every cached object back to the heap.
+ */
+static void tcache_destroy(void *arg) {
+    threadCache *tc = arg;
+
+    arena_lock(tc->home);
+    for (int cls = 0; cls < NUM_SLAB_CLASSES; cls++) {
+	    tcache_drain(tc, cls, tc->counts[cls]);
+    }
+    arena_unlock(tc->home);
+}
+
+static void tcache_make_exit_key(void) {
+    pthread_key_create(&tcache_exit_key, tcache_destroy);
+}
+
+/*
+ * Function for making sure tcache_destroy runs when this thread exits.
+ * The cache is tied to the arena of the node the thread first uses it
+ * on, see local_node().
+ */
+static void tcache_register(threadCache *tc) {
+    if (!tc->registered) {
+	    pthread_once(&tcache_exit_once, tcache_make_exit_key);
+	    pthread_setspecific(tcache_exit_key, tc);
+	    tc->home = node_arenas[local_node()];
+	    tc->registered = 1;
+    }
+}
+
+/*
+ * Function for taking an object of slab class cls from the thread cache,
+ * refilling the bin from the heap first if it is empty.
+ * Returns the object's address or NULL if the heap has no space.
+ */
+static void* tcache_get(int cls) {
+    threadCache *tc = &thread_cache;
+
+    if (tc->bins[cls] == NULL) {
+	    tcache_register(tc);
+	    arena_lock(tc->home);
+	    for (int i = 0; i < TCACHE_BATCH; i++) {
+		    tcacheEntry *entry = slab_alloc(tc->home, cls);
+		    if (entry == NULL) {
+			    break;
+		    }
+		    entry->next = tc->bins[cls];
+		    tc->bins[cls] = entry;
+		    tc->counts[cls]++;
+	    }
+	    if (tc->bins[cls] == NULL) {
+		    tc->home->stats.failed_allocs++;
+	    }
+	    arena_unlock(tc->home);
+
+	    if (tc->bins[cls] == NULL) {
+		    return NULL;
+	    }
+    }
+
+    tcacheEntry *entry = tc->bins[cls];
+    tc->bins[cls] = entry->next;
+    tc->counts[cls]--;
+    entry->key = 0;
+    return entry;
+}
+
+/*
+ * Function for putting a freed object of run, a slab run of arena a, into
+ * the thread cache, draining part of the bin to the heap first if it is
+ * full. Objects of other arenas than the cache's are freed right away.
+ * Returns 0 on success.
+ * Returns -1 if the object is already in this thread's cache.
+ */
+static int tcache_put(arena *a, slabRun *run, void *ptr) {
+    threadCache *tc = &thread_cache;
+    int cls = slab_class(run->obj_size);
+    tcacheEntry *entry = ptr;
+
+    // the key can also match by chance, so confirm by searching the bin
+    if (entry->key == tcache_key_of(tc)) {
+	    for (tcacheEntry *cached = tc->bins[cls]; cached != NULL; cached = cached->next) {
+		    if (cached == entry) {
+			    return -1;
+		    }
+	    }
+    }
+
+    tcache_register(tc);
+    if (a != tc->home) {
+	    return arena_bfree(a, ptr);
+    }
+    if (tc->counts[cls] >= TCACHE_COUNT) {
+	    arena_lock(tc->home);
+	    tcache_drain(tc, cls, TCACHE_BATCH);
+	    arena_unlock(tc->home);
+    }
+
+    entry->next = tc->bins[cls];
+    entry->key = tcache_key_of(tc);
+    tc->bins[cls] = entry;
+    tc->counts[cls]++;
+    return 0;
+}
+#endif
+
+/*
+ * Allocation trace recording, see heap_trace_start().
+ *
+ * Each thread fills its own buffer of records without any lock and writes
+ * it to the trace file with one write() when it is full, so a traced call
+ * only adds a timestamp and a stored record. All buffers are on one list
+ * so that heap_trace_stop() can write what is left in them. A thread's
+ * buffer belongs to the trace generation it was made for, so a thread
+ * never uses a buffer that heap_trace_stop() has already unmapped.
+ */
+#define TRACE_BUFFER_RECORDS 4096
+
+typedef struct traceBuffer {
+    struct traceBuffer *next;
+    unsigned int thread;
+    size_t count;
+    heapTraceRecord records[TRACE_BUFFER_RECORDS];
+} traceBuffer;
+
+static int trace_fd = -1;          // trace file, -1 if not tracing
+static int trace_on;               // read without the trace lock
+static unsigned int trace_generation;
+static unsigned int trace_threads; // buffers made for this trace
+static traceBuffer *trace_buffers;
+static __thread traceBuffer *trace_buffer;
+static __thread unsigned int trace_buffer_generation;
+
+#ifdef HEAP_THREAD_SAFE
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void trace_lock(void) {
+#ifdef HEAP_THREAD_SAFE
+    pthread_mutex_lock(&trace_mutex);
+#endif
+}
+
+static void trace_unlock(void) {
+#ifdef HEAP_THREAD_SAFE
+    pthread_mutex_unlock(&trace_mutex);
+#endif
+}
+
+static int trace_enabled(void) {
+#ifdef HEAP_THREAD_SAFE
+    return __atomic_load_n(&trace_on, __ATOMIC_RELAXED);
+#else
+    return trace_on;
+#endif
+}
+
+static unsigned long long trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long trace_offset(void *ptr) {
+    if (ptr == NULL) {
+	    return HEAP_TRACE_NULL;
+    }
+    return (char*)ptr - (char*)default_arena.heap_start;
+}
+
+/*
+ * Function for writing the records of buf to the trace file and emptying it.
+ * Caller must hold the trace lock.
+ */
+static void trace_write(traceBuffer *buf) {
+    const char *data = (const char*)buf->records;
+    size_t left = buf->count * sizeof(heapTraceRecord);
+
+    while (left > 0) {
+	    ssize_t written = write(trace_fd, data, left);
+	    if (written <= 0) {
+		    heap_error("Error:mem.c: Cannot write the trace file\n");
+		    break;
+	    }
+	    data += written;
+	    left -= written;
+    }
+    buf->count = 0;
+}
+
+/*
+ * Function for getting the calling thread's buffer for the running trace,
+ * making one on first use.
+ * Returns NULL if the trace was stopped or no buffer can be mapped.
+ */
+static traceBuffer* trace_buffer_get(void) {
+#ifdef HEAP_THREAD_SAFE
+    unsigned int generation = __atomic_load_n(&trace_generation, __ATOMIC_RELAXED);
+#else
+    unsigned int generation = trace_generation;
+#endif
+    if (trace_buffer != NULL && trace_buffer_generation == generation) {
+	    return trace_buffer;
+    }
+
+    traceBuffer *buf = mmap(NULL, sizeof(traceBuffer), PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+	    return NULL;
+    }
+    trace_lock();
+    if (trace_fd < 0) {
+	    trace_unlock();
+	    munmap(buf, sizeof(traceBuffer));
+	    return NULL;
+    }
+    buf->thread = trace_threads++;
+    buf->next = trace_buffers;
+    trace_buffers = buf;
+    trace_buffer = buf;
+    trace_buffer_generation = trace_generation;
+    trace_unlock();
+    return buf;
+}
+
+/*
+ * Function for recording one call in the calling thread's buffer.
+ * Argument time: when the call started (bfree) or returned (the others),
+ *   so that a block is never recorded as allocated before it was freed.
+ */
+static void trace_record(unsigned int op, unsigned long long time, size_t size,
+		void *ptr, unsigned long long arg) {
+    traceBuffer *buf = trace_buffer_get();
+    if (buf == NULL) {
+	    return;
+    }
+
+    heapTraceRecord *rec = &buf->records[buf->count++];
+    rec->time = time;
+    rec->size = size;
+    rec->offset = trace_offset(ptr);
+    rec->arg = arg;
+    rec->op = op;
+    rec->thread = buf->thread;
+
+    if (buf->count == TRACE_BUFFER_RECORDS) {
+	    trace_lock();
+	    if (trace_fd >= 0) {
+		    trace_write(buf);
+	    }
+	    buf->count = 0;
+	    trace_unlock();
+    }
+}
+
+/*
+ * Function for starting to record every call of balloc, balloc_aligned,
+ * brealloc, balloc_batch, bfree and bfree_batch on the default arena.
+ * Argument path: the trace file, truncated first. See heapTraceRecord for
+ *   its format and heap_replay.c for a tool that replays it.
+ * Returns 0 on success.
+ * Returns -1 if the heap is not initialized, a trace is already running
+ *   or the file cannot be written.
+ */
+int heap_trace_start(const char *path) {
+    trace_lock();
+    if (trace_fd >= 0) {
+	    heap_error("Error:mem.c: A trace is already running\n");
+	    trace_unlock();
+	    return -1;
+    }
+    if (default_arena.heap_start == NULL) {
+	    heap_error("Error:mem.c: The heap is not initialized\n");
+	    trace_unlock();
+	    return -1;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+	    heap_error("Error:mem.c: Cannot open %s\n", path);
+	    trace_unlock();
+	    return -1;
+    }
+    heapTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HEAP_TRACE_MAGIC, sizeof(header.magic));
+    header.heap_size = load_alloc_size(&default_arena);
+    header.record_size = sizeof(heapTraceRecord);
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+	    heap_error("Error:mem.c: Cannot write %s\n", path);
+	    close(fd);
+	    trace_unlock();
+	    return -1;
+    }
+
+    trace_fd = fd;
+    trace_threads = 0;
+#ifdef HEAP_THREAD_SAFE
+    __atomic_add_fetch(&trace_generation, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace_on, 1, __ATOMIC_RELAXED);
+#else
+    trace_generation++;
+    trace_on = 1;
+#endif
+    trace_unlock();
+    return 0;
+}
+
+/*
+ * Function for stopping the running trace, writing the records left in
+ * every thread's buffer and closing the file.
+ * In thread-safe mode no other thread may be in a traced call meanwhile.
+ * Returns 0 on success.
+ * Returns -1 if no trace is running or the file cannot be closed.
+ */
+int heap_trace_stop(void) {
+    trace_lock();
+    if (trace_fd < 0) {
+	    heap_error("Error:mem.c: No trace is running\n");
+	    trace_unlock();
+	    return -1;
+    }
+#ifdef HEAP_THREAD_SAFE
+    __atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+#else
+    trace_on = 0;
+#endif
+
+    while (trace_buffers != NULL) {
+	    traceBuffer *buf = trace_buffers;
+	    trace_buffers = buf->next;
+	    trace_write(buf);
+	    munmap(buf, sizeof(traceBuffer));
+    }
+    int ret = close(trace_fd) == 0 ? 0 : -1;
+    trace_fd = -1;
+    trace_unlock();
+    return ret;
+}
+
+/*
+ * Sampling heap profiler, see heap_profile_start().
+ *
+ * Every thread counts down the bytes it allocates with balloc and takes a
+ * sample when the count drops below zero, then draws the next count from
+ * an exponential distribution so samples form a Poisson process over the
+ * allocated bytes. An unsampled balloc only pays the decrement. While no
+ * profile runs the countdown is reset to PROFILE_RECHECK_BYTES, so a
+ * thread notices a started profile after at most that many bytes.
+ *
+ * A sample holds the block address, its size and the index of its call
+ * stack. Samples are chained from profile_buckets by address hash, and
+ * bfree reads the bucket head of its block without the profile lock; only
+ * a non-empty bucket means the block may be sampled. The tables are mapped
+ * by the first heap_profile_start() and never unmapped, so that read stays
+ * safe after the profile stops.
+ */
+#define PROFILE_DEFAULT_BYTES (512 * 1024)
+#define PROFILE_RECHECK_BYTES (1024 * 1024)
+#define PROFILE_MAX_DEPTH     32
+#define PROFILE_BUCKETS       (1 << 16)
+#define PROFILE_MAX_SAMPLES   (1 << 16)
+#define PROFILE_MAX_STACKS    (1 << 14)
+
+typedef struct profileStack {
+    unsigned int next;            // next in chain, index + 1, 0 at the end
+    unsigned int depth;
+    void *pcs[PROFILE_MAX_DEPTH];
+    size_t inuse_objs;
+    size_t inuse_bytes;
+    size_t alloc_objs;
+    size_t alloc_bytes;
+} profileStack;
+
+typedef struct profileSample {
+    unsigned int next;            // next in chain or free list, index + 1
+    unsigned int stack;           // index into profile_stacks
+    void *ptr;
+    size_t size;
+} profileSample;
+
+typedef struct profileTables {
+    unsigned int buckets[PROFILE_BUCKETS];        // samples by address
+    unsigned int stack_buckets[PROFILE_BUCKETS];  // stacks by pc hash
+    profileSample samples[PROFILE_MAX_SAMPLES];
+    profileStack stacks[PROFILE_MAX_STACKS];
+    unsigned int free_samples;    // free list of samples, index + 1
+    unsigned int used_stacks;
+} profileTables;
+
+static profileTables *profile;    // NULL until the first profile
+static int profile_on;            // read without the profile lock
+static size_t profile_mean;       // mean bytes between samples
+static size_t profile_dropped;    // samples lost to full tables
+static __thread long long profile_countdown;
+static __thread unsigned long long profile_rand;
+
+#ifdef HEAP_THREAD_SAFE
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void profile_lock(void) {
+#ifdef HEAP_THREAD_SAFE
+    pthread_mutex_lock(&profile_mutex);
+#endif
+}
+
+static void profile_unlock(void) {
+#ifdef HEAP_THREAD_SAFE
+    pthread_mutex_unlock(&profile_mutex);
+#endif
+}
+
+static unsigned int profile_hash(unsigned long long key) {
+    return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 48) & (PROFILE_BUCKETS - 1);
+}
+
+/*
+ * Function for a natural logarithm without libm, accurate to about 1e-6,
+ * which is plenty for drawing sample intervals.
+ */
+static double profile_log(double x) {
+    union { double d; unsigned long long u; } bits = { x };
+    int exponent = (int)((bits.u >> 52) & 0x7FF) - 1023;
+    bits.u = (bits.u & ~(0x7FFULL << 52)) | (1023ULL << 52);
+
+    // ln(m) = 2 atanh((m - 1) / (m + 1)) for the mantissa m in [1, 2)
+    double t = (bits.d - 1) / (bits.d + 1), t2 = t * t;
+    double series = t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 + t2 * (1.0 / 9)))));
+    return exponent * 0.6931471805599453 + 2 * series;
+}
+
+/*
+ * Function for drawing the number of bytes until the calling thread's
+ * next sample, exponentially distributed with mean profile_mean.
+ */
+static long long profile_interval(void) {
+    if (profile_rand == 0) {
+	    profile_rand = (unsigned long long)(size_t)&profile_rand ^ trace_now();
+	    profile_rand |= 1;
+    }
+    // xorshift64
+    profile_rand ^= profile_rand << 13;
+    profile_rand ^= profile_rand >> 7;
+    profile_rand ^= profile_rand << 17;
+    double u = ((profile_rand >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return (long long)(-profile_log(u) * profile_mean) + 1;
+}
+
+static int profile_enabled(void) {
+#ifdef HEAP_THREAD_SAFE
+    return __atomic_load_n(&profile_on, __ATOMIC_RELAXED);
+#else
+    return profile_on;
+#endif
+}
+
+/*
+ * Function for finding the stack of pcs in the stack table, adding it if
+ * it is new. Caller must hold the profile lock.
+ * Returns the stack's index, or -1 if the table is full.
+ */
+static int profile_stack_of(void **pcs, int depth) {
+    unsigned long long key = depth;
+    for (int i = 0; i < depth; i++) {
+	    key = key * 31 + (unsigned long long)(size_t)pcs[i];
+    }
+    unsigned int bucket = profile_hash(key);
+
+    for (unsigned int i = profile->stack_buckets[bucket]; i != 0; i = profile->stacks[i - 1].next) {
+	    profileStack *stack = &profile->stacks[i - 1];
+	    if (stack->depth == (unsigned int)depth &&
+			    memcmp(stack->pcs, pcs, depth * sizeof(void*)) == 0) {
+		    return i - 1;
+	    }
+    }
+    if (profile->used_stacks == PROFILE_MAX_STACKS) {
+	    return -1;
+    }
+    int index = profile->used_stacks++;
+    profileStack *stack = &profile->stacks[index];
+    memset(stack, 0, sizeof(profileStack));
+    stack->depth = depth;
+    memcpy(stack->pcs, pcs, depth * sizeof(void*));
+    stack->next = profile->stack_buckets[bucket];
+    profile->stack_buckets[bucket] = index + 1;
+    return index;
+}
+
+/*
+ * Function for adding a sample of ptr to the tables.
+ * Caller must hold the profile lock.
+ */
+static void profile_insert(void *ptr, size_t size, unsigned int stackIndex) {
+    if (profile->free_samples == 0) {
+	    profile_dropped++;
+	    return;
+    }
+    unsigned int index = profile->free_samples;
+    profileSample *sample = &profile->samples[index - 1];
+    profile->free_samples = sample->next;
+
+    sample->ptr = ptr;
+    sample->size = size;
+    sample->stack = stackIndex;
+    unsigned int bucket = profile_hash((size_t)ptr);
+    sample->next = profile->buckets[bucket];
+#ifdef HEAP_THREAD_SAFE
+    __atomic_store_n(&profile->buckets[bucket], index, __ATOMIC_RELAXED);
+#else
+    profile->buckets[bucket] = index;
+#endif
+
+    profileStack *stack = &profile->stacks[stackIndex];
+    stack->inuse_objs++;
+    stack->inuse_bytes += size;
+}
+
+/*
+ * Function for telling whether ptr may be a sampled block, without the
+ * profile lock.
+ */
+static int profile_maybe_sampled(void *ptr) {
+#ifdef HEAP_THREAD_SAFE
+    profileTables *tables = __atomic_load_n(&profile, __ATOMIC_ACQUIRE);
+    return tables != NULL &&
+		    __atomic_load_n(&tables->buckets[profile_hash((size_t)ptr)], __ATOMIC_RELAXED) != 0;
+#else
+    return profile != NULL && profile->buckets[profile_hash((size_t)ptr)] != 0;
+#endif
+}
+
+/*
+ * Function for removing the sample of ptr, if there is one.
+ * Argument size, stackIndex: set to the sample's size and stack.
+ * Returns 0 if ptr was sampled, -1 if not.
+ */
+static int profile_take(void *ptr, size_t *size, unsigned int *stackIndex) {
+    int ret = -1;
+
+    profile_lock();
+    unsigned int bucket = profile_hash((size_t)ptr);
+    for (unsigned int *link = &profile->buckets[bucket]; *link != 0; link = &profile->samples[*link - 1].next) {
+	    unsigned int index = *link;
+	    profileSample *sample = &profile->samples[index - 1];
+	    if (sample->ptr != ptr) {
+		    continue;
+	    }
+#ifdef HEAP_THREAD_SAFE
+	    __atomic_store_n(link, sample->next, __ATOMIC_RELAXED);
+#else
+	    *link = sample->next;
+#endif
+	    *size = sample->size;
+	    *stackIndex = sample->stack;
+	    profileStack *stack = &profile->stacks[sample->stack];
+	    stack->inuse_objs--;
+	    stack->inuse_bytes -= sample->size;
+
+	    sample->next = profile->free_samples;
+	    profile->free_samples = index;
+	    ret = 0;
+	    break;
+    }
+    profile_unlock();
+    return ret;
+}
+
+/*
+ * Function for forgetting the sample of a block about to be freed. It
+ * must go before the block does, or another thread could get the address
+ * back and sample it first.
+ */
+static void profile_forget(void *ptr) {
+    size_t size;
+    unsigned int stackIndex;
+    if (profile_maybe_sampled(ptr)) {
+	    profile_take(ptr, &size, &stackIndex);
+    }
+}
+
+/*
+ * Function for putting back a sample that profile_take() removed, unless
+ * the profile was stopped meanwhile.
+ */
+static void profile_keep(void *ptr, size_t size, unsigned int stackIndex) {
+    profile_lock();
+    if (profile_on && stackIndex < profile->used_stacks) {
+	    profile_insert(ptr, size, stackIndex);
+    }
+    profile_unlock();
+}
+
+/*
+ * Function for the slow path of the countdown in balloc: sampling ptr if
+ * a profile runs and drawing the next countdown.
+ * Not inlined so that its return address is in balloc.
+ */
+__attribute__((noinline))
+static void profile_sample(void *ptr, size_t size) {
+    if (!profile_enabled()) {
+	    profile_countdown = PROFILE_RECHECK_BYTES;
+	    return;
+    }
+    profile_countdown = profile_interval();
+    if (ptr == NULL) {
+	    return;
+    }
+
+    // skip the frames up to balloc's, found by its return address as
+    // some backtrace implementations leave out their caller
+    void *pcs[PROFILE_MAX_DEPTH + 2];
+    void *inBalloc = __builtin_return_address(0);
+    int depth = backtrace(pcs, PROFILE_MAX_DEPTH + 2);
+    int skip = depth < 2 ? depth : 2;
+    for (int i = 0; i < depth && i < 3; i++) {
+	    if (pcs[i] == inBalloc) {
+		    skip = i + 1;
+		    break;
+	    }
+    }
+    depth -= skip;
+
+    profile_lock();
+    if (profile_on) {
+	    int stackIndex = profile_stack_of(pcs + skip, depth);
+	    if (stackIndex < 0) {
+		    profile_dropped++;
+	    } else {
+		    profile->stacks[stackIndex].alloc_objs++;
+		    profile->stacks[stackIndex].alloc_bytes += size;
+		    profile_insert(ptr, size, stackIndex);
+	    }
+    }
+    profile_unlock();
+}
+
+/*
+ * Function for emptying the profile tables. Caller must hold the profile
+ * lock.
+ */
+static void profile_reset(void) {
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+#ifdef HEAP_THREAD_SAFE
+	    __atomic_store_n(&profile->buckets[i], 0, __ATOMIC_RELAXED);
+#else
+	    profile->buckets[i] = 0;
+#endif
+	    profile->stack_buckets[i] = 0;
+    }
+    for (int i = 0; i < PROFILE_MAX_SAMPLES; i++) {
+	    profile->samples[i].next = i + 1 < PROFILE_MAX_SAMPLES ? i + 2 : 0;
+    }
+    profile->free_samples = 1;
+    profile->used_stacks = 0;
+    profile_dropped = 0;
+}
+
+/*
+ * Function for starting to sample balloc calls on the default arena.
+ * Argument sampleBytes: mean number of allocated bytes between samples,
+ *   0 for PROFILE_DEFAULT_BYTES. The intervals between samples are
+ *   random, so call sites that allocate in a fixed pattern are not missed.
+ * Only balloc takes samples; brealloc keeps following a sampled block and
+ *   bfree and bfree_batch drop it.
+ * Returns 0 on success.
+ * Returns -1 if a profile already runs or the tables cannot be mapped.
+ */
+int heap_profile_start(size_t sampleBytes) {
+    profile_lock();
+    if (profile_on) {
+	    heap_error("Error:mem.c: A profile is already running\n");
+	    profile_unlock();
+	    return -1;
+    }
+    if (profile == NULL) {
+	    profileTables *tables = mmap(NULL, sizeof(profileTables), PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	    if (tables == MAP_FAILED) {
+		    heap_error("Error:mem.c: Cannot map the profile tables\n");
+		    profile_unlock();
+		    return -1;
+	    }
+#ifdef HEAP_THREAD_SAFE
+	    __atomic_store_n(&profile, tables, __ATOMIC_RELEASE);
+#else
+	    profile = tables;
+#endif
+    }
+    profile_reset();
+    profile_mean = sampleBytes != 0 ? sampleBytes : PROFILE_DEFAULT_BYTES;
+#ifdef HEAP_THREAD_SAFE
+    __atomic_store_n(&profile_on, 1, __ATOMIC_RELAXED);
+#else
+    profile_on = 1;
+#endif
+    profile_unlock();
+    return 0;
+}
+
+/*
+ * Function for stopping the running profile and dropping its samples.
+ * Take a heap_profile_dump() first to keep them.
+ * Returns 0 on success.
+ * Returns -1 if no profile runs.
+ */
+int heap_profile_stop(void) {
+    profile_lock();
+    if (!profile_on) {
+	    heap_error("Error:mem.c: No profile is running\n");
+	    profile_unlock();
+	    return -1;
+    }
+#ifdef HEAP_THREAD_SAFE
+    __atomic_store_n(&profile_on, 0, __ATOMIC_RELAXED);
+#else
+    profile_on = 0;
+#endif
+    profile_reset();
+    profile_unlock();
+    return 0;
+}
+
+/*
+ * Function for writing the running profile in the legacy heap profile
+ * format that pprof reads, e.g. "pprof --text program file":
+ *   heap profile: <objs>: <bytes> [<objs>: <bytes>] @ heap_v2/<interval>
+ *   <objs>: <bytes> [<objs>: <bytes>] @ <pc> <pc> ...
+ * with the live sampled objects and bytes first and all sampled so far in
+ * brackets, followed by the process's memory map. pprof scales the sampled
+ * numbers up by the sampling interval itself.
+ * Returns 0 on success.
+ * Returns -1 if no profile runs.
+ */
+int heap_profile_dump(FILE *out) {
+    profile_lock();
+    if (!profile_on) {
+	    heap_error("Error:mem.c: No profile is running\n");
+	    profile_unlock();
+	    return -1;
+    }
+
+    size_t inuseObjs = 0, inuseBytes = 0, allocObjs = 0, allocBytes = 0;
+    for (unsigned int i = 0; i < profile->used_stacks; i++) {
+	    inuseObjs += profile->stacks[i].inuse_objs;
+	    inuseBytes += profile->stacks[i].inuse_bytes;
+	    allocObjs += profile->stacks[i].alloc_objs;
+	    allocBytes += profile->stacks[i].alloc_bytes;
+    }
+    fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+		    inuseObjs, inuseBytes, allocObjs, allocBytes, profile_mean);
+    for (unsigned int i = 0; i < profile->used_stacks; i++) {
+	    profileStack *stack = &profile->stacks[i];
+	    fprintf(out, "%zu: %zu [%zu: %zu] @", stack->inuse_objs, stack->inuse_bytes,
+			    stack->alloc_objs, stack->alloc_bytes);
+	    for (unsigned int d = 0; d < stack->depth; d++) {
+		    fprintf(out, " %p", stack->pcs[d]);
+	    }
+	    fprintf(out, "\n");
+    }
+    profile_unlock();
+
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    int fd = open("/proc/self/maps", O_RDONLY);
+    if (fd >= 0) {
+	    char buf[4096];
+	    ssize_t n;
+	    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		    fwrite(buf, 1, n, out);
+	    }
+	    close(fd);
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+ * Function for allocating 'size' bytes of heap memory from the default
+ * arena, or the calling thread's node arena, see heap_balloc() and
+ * local_node().
+ *
+ * In thread-safe mode small requests are served from the calling thread's
+ * cache and everything else takes the arena lock.
+ */
+static void* default_balloc(size_t size) {
+    int node = local_node();
+    void *ptr;
+#ifdef HEAP_THREAD_SAFE
+    if (size >= 1 && size <= SLAB_MAX && node_arenas[node]->slab_map != NULL) {
+	    ptr = tcache_get(slab_class(size));
+    } else {
+	    ptr = arena_balloc(node_arenas[node], size);
+    }
+#else
+    ptr = arena_balloc(node_arenas[node], size);
+#endif
+    for (int i = 1; ptr == NULL && i < num_nodes; i++) {
+	    arena *a = node_arenas[(node + i) % num_nodes];
+	    if (a != NULL) {
+		    ptr = arena_balloc(a, size);
+	    }
+    }
+    return ptr;
+}
+
+/*
+ * Function for freeing up a block allocated by balloc(), see heap_bfree().
+ *
+ * In thread-safe mode small blocks go to the calling thread's cache and
+ * everything else takes the arena lock.
+ */
+static int default_bfree(void *ptr) {
+    arena *a = arena_of(ptr);
+#ifdef HEAP_THREAD_SAFE
+    // a run stays in the slab map while it has allocated objects and an
+    // object's free bit only changes in bfree, so both can be checked
+    // without the lock
+    slabRun *run = slab_run_of(a, ptr);
+    if (run != NULL) {
+	    if (slab_index_of(a, run, ptr) < 0) {
+		    return -1;
+	    }
+	    return tcache_put(a, run, ptr);
+    }
+#endif
+    return arena_bfree(a, ptr);
+}
+
+/*
+ * Function for finding the usable payload bytes of an allocated block or
+ * slab object, the requested ones for a block in the debug build.
+ * Returns 0 if ptr is not one of a.
+ * Caller must hold the arena lock.
+ */
+static size_t usable_size(arena *a, void *ptr) {
+    slabRun *run = slab_run_of(a, ptr);
+    if (run != NULL) {
+	    return slab_index_of(a, run, ptr) < 0 ? 0 : run->obj_size;
+    }
+    blockHeader *block = ptr_to_block(a, ptr);
+    if (block == NULL) {
+	    mappedBlock *mb = mapped_of(a, ptr);
+	    return mb == NULL ? 0 : mb->length - MAPPED_OFFSET;
+    }
+    return payload_size(block);
+}
+
+/*
+ * Function for moving a block of a that brealloc could not resize to a
+ * new block of 'size' bytes in any node arena, see default_balloc().
+ * Returns the new block, NULL if ptr is not a block of a or no arena has
+ *   space, which leaves the old block as it was.
+ */
+static void* move_to_node(arena *a, void *ptr, size_t size) {
+    arena_lock(a);
+    size_t oldSize = usable_size(a, ptr);
+    arena_unlock(a);
+    if (oldSize == 0) {
+	    return NULL;
+    }
+
+    void *newPtr = default_balloc(size);
+    if (newPtr == NULL) {
+	    return NULL;
+    }
+    memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+    default_bfree(ptr);
+    return newPtr;
+}
+
+/*
+ * Function for allocating 'size' bytes from the default arena, see
+ * default_balloc().
+ */
+void* balloc(size_t size) {
+    void *ptr = default_balloc(size);
+    if ((profile_countdown -= size) < 0) {
+	    profile_sample(ptr, size);
+    }
+    if (trace_enabled()) {
+	    trace_record(HEAP_TRACE_BALLOC, trace_now(), size, ptr, 0);
+    }
+    return ptr;
+}
+
+/*
+ * Function for allocating count blocks from the default arena, see
+ * heap_balloc_batch().
+ */
+size_t balloc_batch(size_t size, size_t count, void **out) {
+    int node = local_node();
+    size_t got = arena_balloc_batch(node_arenas[node], size, count, out);
+    for (int i = 1; got < count && i < num_nodes; i++) {
+	    arena *a = node_arenas[(node + i) % num_nodes];
+	    if (a != NULL) {
+		    got += arena_balloc_batch(a, size, count - got, out + got);
+	    }
+    }
+    if (trace_enabled()) {
+	    unsigned long long time = trace_now();
+	    for (size_t i = 0; i < got; i++) {
+		    trace_record(HEAP_TRACE_BALLOC, time, size, out[i], 0);
+	    }
+    }
+    return got;
+}
+
+/*
+ * Function for freeing n blocks of the default arena, see heap_bfree_batch().
+ */
+int bfree_batch(void **ptrs, size_t n) {
+    if (trace_enabled()) {
+	    unsigned long long time = trace_now();
+	    for (size_t i = 0; i < n; i++) {
+		    if (ptrs[i] != NULL) {
+			    trace_record(HEAP_TRACE_BFREE, time, 0, ptrs[i], 0);
+		    }
+	    }
+    }
+    for (size_t i = 0; i < n; i++) {
+	    profile_forget(ptrs[i]);
+    }
+    if (num_nodes == 1) {
+	    return arena_bfree_batch(&default_arena, ptrs, n);
+    }
+    // the blocks can be spread over the node arenas
+    int ret = 0;
+    for (size_t i = 0; i < n; i++) {
+	    if (ptrs[i] != NULL && default_bfree(ptrs[i]) != 0) {
+		    ret = -1;
+	    }
+    }
+    return ret;
+}
+
+/*
+ * Function for resizing a block of the default arena, see heap_brealloc().
+ */
+void* brealloc(void *ptr, size_t size) {
+    size_t sampleSize;
+    unsigned int stackIndex;
+    // the sample moves along with the block, or stays if brealloc fails
+    int sampled = profile_maybe_sampled(ptr) && profile_take(ptr, &sampleSize, &stackIndex) == 0;
+
+    void *newPtr;
+    if (ptr == NULL) {
+	    newPtr = default_balloc(size);
+    } else {
+	    arena *a = arena_of(ptr);
+	    newPtr = arena_brealloc(a, ptr, size);
+	    // the block's node arena is full, move it to another one
+	    if (newPtr == NULL && num_nodes > 1 && size >= 1 && size <= HEAP_MAX_SIZE) {
+		    newPtr = move_to_node(a, ptr, size);
+	    }
+    }
+    if (sampled) {
+	    if (newPtr != NULL) {
+		    profile_keep(newPtr, size, stackIndex);
+	    } else {
+		    profile_keep(ptr, sampleSize, stackIndex);
+	    }
+    }
+    if (trace_enabled()) {
+	    trace_record(HEAP_TRACE_REALLOC, trace_now(), size, newPtr, trace_offset(ptr));
+    }
+    return newPtr;
+}
+
+/*
+ * Function for allocating a zeroed array from the default arena, see
+ * heap_bcalloc(). Slab objects come from the thread cache like balloc's
+ * and are always cleared.
+ */
+void* bcalloc(size_t n, size_t size) {
+    if (size != 0 && n > HEAP_MAX_SIZE / size) {
+	    return NULL;
+    }
+    void *ptr;
+    if (n * size >= 1 && n * size <= SLAB_MAX) {
+	    ptr = default_balloc(n * size);
+	    if (ptr != NULL) {
+		    memset(ptr, 0, n * size);
+	    }
+    } else {
+	    int node = local_node();
+	    ptr = arena_bcalloc(node_arenas[node], n, size);
+	    for (int i = 1; ptr == NULL && i < num_nodes; i++) {
+		    arena *a = node_arenas[(node + i) % num_nodes];
+		    if (a != NULL) {
+			    ptr = arena_bcalloc(a, n, size);
+		    }
+	    }
+    }
+    if ((profile_countdown -= n * size) < 0) {
+	    profile_sample(ptr, n * size);
+    }
+    if (trace_enabled()) {
+	    trace_record(HEAP_TRACE_BALLOC, trace_now(), n * size, ptr, 0);
+    }
+    return ptr;
+}
+
+/*
+ * Function for allocating 'size' bytes aligned to align from the default
+ * arena, see heap_balloc_aligned().
+ */
+void* balloc_aligned(size_t size, size_t align) {
+    int node = local_node();
+    void *ptr = arena_balloc_aligned(node_arenas[node], size, align);
+    for (int i = 1; ptr == NULL && i < num_nodes; i++) {
+	    arena *a = node_arenas[(node + i) % num_nodes];
+	    if (a != NULL) {
+		    ptr = arena_balloc_aligned(a, size, align);
+	    }
+    }
+    if (trace_enabled()) {
+	    trace_record(HEAP_TRACE_ALIGNED, trace_now(), size, ptr, align);
+    }
+    return ptr;
+}
+
+/*
+ * Function for freeing a block of the default arena, see default_bfree().
+ */
+int bfree(void *ptr) {
+    profile_forget(ptr);
+    if (!trace_enabled()) {
+	    return default_bfree(ptr);
+    }
+    unsigned long long time = trace_now();
+    int ret = default_bfree(ptr);
+    if (ret == 0) {
+	    trace_record(HEAP_TRACE_BFREE, time, 0, ptr, 0);
+    }
+    return ret;
+}
+
+/*
+ * Function for traversing heap block list and coalescing all adjacent 
+ * free blocks.
+ *
+ * This function is used for user-called coalescing.
+ * Updated header size_status and footer size_status as needed.
+ *
+ * bfree already coalesces immediately, so this pass only finds work
+ * if the heap was modified outside balloc/bfree.
+ *
+ * Argument a: the arena to coalesce.
+ * Returns -1 if the arena is corrupt, see arena_lock(), 0 otherwise.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static int heap_coalesce(arena *a) {
+    if (a->corrupt) {
+	    return -1;
+    }
+    blockHeader *current = a->heap_start;
+
+    // merged blocks change size, so the free lists are rebuilt as we go
+    memset(a->free_lists, 0, sizeof(a->free_lists));
+    a->free_list_map = 0;
+    a->coalesce_next = NULL;
+    a->rover = NULL;
+    a->stats.free_blocks = 0;
+    a->stats.bytes_free = 0;
+
+    // while we are not at end of the heap
+    while (!is_end_mark(current)) {
+	    // if current block is free
+	    if (!(current->size_status & 1)) {
+		    // get next block
+		    blockHeader *nextBlock = (blockHeader*)((char*)current + (current->size_status & ~3));
+		    // while next block is free (the end mark is never free)
+		    while (!(nextBlock->size_status & 1)) {
+			    // get new next block
+			    current->size_status += (nextBlock->size_status & ~3);
+			    a->stats.merges++;
+			    nextBlock = (blockHeader*)((char*)current + (current->size_status & ~3));
+		    }
+
+		    // set previous block free bit, also on the end mark
+		    clear_pbit(nextBlock);
+		    set_footer(current, current->size_status & ~3);
+		    free_list_insert(a, current);
+	    }
+	    // move to next block
+	    current = (blockHeader*)((char*)current + (current->size_status & ~3));
+    }
+
+	    // coalesced all adjacent free blocks
+    return 0;
+}
+
+/*
+ * Function for coalescing a bounded part of the heap.
+ * Argument maxBlocks: the most blocks to visit in this call.
+ * Returns the number of free bytes merged into preceding free blocks.
+ *
+ * Each call goes on where the previous one stopped and starts over at
+ * heap_start once it reaches the end mark, so repeated calls sweep the
+ * whole heap without a long pause. The cursor is moved whenever the block
+ * it points at is merged into another block, see merge_cursor(). Unlike
+ * heap_coalesce() it relies on every free block being on its free list.
+ *
+ * Argument a: the arena to coalesce.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static size_t heap_coalesce_step(arena *a, size_t maxBlocks) {
+    size_t merged = 0;
+    blockHeader *current = a->coalesce_next ? a->coalesce_next : a->heap_start;
+
+    // the heap was never set up or cannot be walked
+    if (current == NULL || a->corrupt) {
+	    return 0;
+    }
+
+    while (maxBlocks-- > 0 && !is_end_mark(current)) {
+	    size_t size = current->size_status & ~3;
+	    blockHeader *nextBlock = (blockHeader*)((char*)current + size);
+
+	    // if current block and next block are free merge them all
+	    if (!(current->size_status & 1) && !(nextBlock->size_status & 1)) {
+		    free_list_remove(a, current);
+		    while (!(nextBlock->size_status & 1)) {
+			    free_list_remove(a, nextBlock);
+			    merge_cursor(a, nextBlock, current);
+			    size += nextBlock->size_status & ~3;
+			    merged += nextBlock->size_status & ~3;
+			    a->stats.merges++;
+			    nextBlock = (blockHeader*)((char*)current + size);
+		    }
+		    set_footer(current, size);
+		    publish_header(current, size | (current->size_status & 2));
+		    free_list_insert(a, current);
+		    clear_pbit(nextBlock);
+	    }
+	    current = nextBlock;
+    }
+
+    // start over on the next call once the end is reached
+    a->coalesce_next = is_end_mark(current) ? NULL : current;
+    return merged;
+}
+
+/*
+ * Function for finding the size of the largest free block.
+ * Only the highest non-empty size class is looked at: the tree class
+ * keeps its largest block at the far right, and a list class is short
+ * enough to scan since everything above TREE_MIN_SIZE is in the tree.
+ */
+static size_t largest_free_block(arena *a) {
+    if (a->free_list_map == 0) {
+	    return 0;
+    }
+
+    int cls = 63 - __builtin_clzll(a->free_list_map);
+    blockHeader *current = link_to_block(a, a->free_lists[cls]);
+    if (cls == TREE_CLASS) {
+	    while (tree_links_of(current)->right != 0) {
+		    current = link_to_block(a, tree_links_of(current)->right);
+	    }
+	    return current->size_status & ~3;
+    }
+
+    size_t largest = 0;
+    for (; current != NULL; current = link_to_block(a, links_of(current)->next)) {
+	    if ((current->size_status & ~3) > largest) {
+		    largest = current->size_status & ~3;
+	    }
+    }
+    return largest;
+}
+
+/*
+ * Function for reading an arena's statistics without walking its blocks.
+ * Argument stats: filled in with the counters and the values derived from
+ *   them. A slab run counts as one allocated block; its objects are
+ *   counted in slab_objects, including those held in thread caches.
+ * Returns 0 on success.
+ * Returns -1 if stats is NULL.
+ *
+ * Argument a: the arena to read.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static int heap_read_stats(arena *a, heapStats *stats) {
+    if (stats == NULL) {
+	    return -1;
+    }
+
+    *stats = a->stats;
+    stats->heap_size = a->alloc_size;
+    stats->bytes_in_use = a->alloc_size - a->stats.bytes_free;
+    // the heap starts as one block, every split or grow adds one and
+    // every merge removes one
+    stats->used_blocks = 1 + a->stats.splits + a->stats.grows - a->stats.merges - a->stats.free_blocks;
+    stats->largest_free = largest_free_block(a);
+    if (a->heap_start == NULL) {
+	    stats->used_blocks = 0;
+    }
+    return 0;
+}
+
+/*
+ * Function for checking a free list entry: a free block inside the heap
+ * whose size is of class cls.
+ */
+static int listed_ok(arena *a, blockHeader *block, int cls) {
+    char *end = (char*)a->heap_start + a->alloc_size;
+    if ((char*)block < (char*)a->heap_start || (char*)block >= end || (block->size_status & 1)) {
+	    return 0;
+    }
+    return size_class(block->size_status & ~3) == cls;
+}
+
+/*
+ * Function for checking the tree of large free blocks below root, see
+ * tree_insert(), visiting at most limit blocks.
+ * Returns the number of blocks in the tree.
+ * Returns more than limit if the tree is broken or larger.
+ */
+static size_t tree_check(arena *a, heapWord root, size_t limit) {
+    if (root == 0) {
+	    return 0;
+    }
+    blockHeader *node = link_to_block(a, root);
+    if (limit == 0 || !listed_ok(a, node, TREE_CLASS)) {
+	    return limit + 1;
+    }
+    treeLinks *links = tree_links_of(node);
+    size_t left = tree_check(a, links->left, limit - 1);
+    if (left > limit - 1 || (links->left != 0 && !tree_before(link_to_block(a, links->left), node))) {
+	    return limit + 1;
+    }
+    size_t right = tree_check(a, links->right, limit - 1 - left);
+    if (right > limit - 1 - left || (links->right != 0 && tree_before(link_to_block(a, links->right), node))) {
+	    return limit + 1;
+    }
+    return 1 + left + right;
+}
+
+/*
+ * Function for checking that an arena is consistent:
+ * - Every block has a size of at least MIN_BLOCK_SIZE that is a multiple
+ *   of HEAP_ALIGNMENT and its p-bit matches the a-bit of the block before.
+ * - Every allocated block is in the block map and its canary is intact,
+ *   see HEAP_DEBUG.
+ * - Every free block's footer matches its header and no two free blocks
+ *   are next to each other.
+ * - The chain ends at the end mark, exactly alloc_size bytes in.
+ * - The counts and sizes of free, used and mapped blocks match the
+ *   counters, and the free lists hold every free block once.
+ * Nothing is written and nothing is allocated. The cost is one walk over
+ * the blocks and the free lists with the arena lock held, so it can run
+ * every so many operations, e.g. in a canary deployment.
+ * Returns 0 if the arena is consistent.
+ * Returns -1 after printing the first problem found.
+ *
+ * Argument a: the arena to check.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static int heap_validate(arena *a) {
+    if (a->heap_start == NULL) {
+	    return 0;
+    }
+    if (a->corrupt) {
+	    heap_error("Error:mem.c: Shared heap is corrupt\n");
+	    return -1;
+    }
+    char *end = (char*)a->heap_start + a->alloc_size;
+    blockHeader *current = a->heap_start;
+    size_t usedBlocks = 0, freeBlocks = 0, bytesFree = 0;
+    size_t prevAlloc = 1; // the first block's p-bit is set
+
+    while ((char*)current < end) {
+	    size_t size = current->size_status & ~3;
+	    if (size < MIN_BLOCK_SIZE || size % HEAP_ALIGNMENT != 0 || size > (size_t)(end - (char*)current)) {
+		    heap_error("Error:mem.c: Block at %p has a bad size %zu\n", (void*)current, size);
+		    return -1;
+	    }
+	    if (((current->size_status >> 1) & 1) != prevAlloc) {
+		    heap_error("Error:mem.c: P-bit of the block at %p does not match the block before it\n", (void*)current);
+		    return -1;
+	    }
+	    if (current->size_status & 1) {
+		    // blocks queued by remote_push() are still allocated
+		    if (!block_map_test(a, current)) {
+			    heap_error("Error:mem.c: Block at %p is not in the block map\n", (void*)current);
+			    return -1;
+		    }
+		    if (payload_size(current) == 0) {
+			    heap_error("Error:mem.c: Canary of the block at %p is overwritten\n", (void*)(current + 1));
+			    return -1;
+		    }
+		    usedBlocks++;
+	    } else {
+		    if (!prevAlloc) {
+			    heap_error("Error:mem.c: Free block at %p follows a free block\n", (void*)current);
+			    return -1;
+		    }
+		    if (((blockHeader*)((char*)current + size) - 1)->size_status != size) {
+			    heap_error("Error:mem.c: Footer of the free block at %p does not match its header\n", (void*)current);
+			    return -1;
+		    }
+		    freeBlocks++;
+		    bytesFree += size;
+	    }
+	    prevAlloc = current->size_status & 1;
+	    current = (blockHeader*)((char*)current + size);
+    }
+    if ((char*)current != end || (current->size_status & ~2) != 1 || ((current->size_status >> 1) & 1) != prevAlloc) {
+	    heap_error("Error:mem.c: End mark at %p is broken\n", (void*)current);
+	    return -1;
+    }
+
+    if (freeBlocks != a->stats.free_blocks || bytesFree != a->stats.bytes_free) {
+	    heap_error("Error:mem.c: Heap has %zu free blocks of %zu bytes, the counters %zu of %zu\n",
+			    freeBlocks, bytesFree, a->stats.free_blocks, a->stats.bytes_free);
+	    return -1;
+    }
+    // see heap_read_stats()
+    if (usedBlocks != 1 + a->stats.splits + a->stats.grows - a->stats.merges - a->stats.free_blocks) {
+	    heap_error("Error:mem.c: Heap has %zu used blocks, the counters %zu\n", usedBlocks,
+			    1 + a->stats.splits + a->stats.grows - a->stats.merges - a->stats.free_blocks);
+	    return -1;
+    }
+
+    // every listed block counts against freeBlocks, so a cycle ends the walk
+    size_t listed = 0;
+    for (int cls = 0; cls < NUM_CLASSES; cls++) {
+	    if (((a->free_list_map >> cls) & 1) != (a->free_lists[cls] != 0)) {
+		    heap_error("Error:mem.c: Free list map bit %d is wrong\n", cls);
+		    return -1;
+	    }
+	    if (cls == TREE_CLASS) {
+		    size_t n = tree_check(a, a->free_lists[cls], freeBlocks - listed);
+		    if (n > freeBlocks - listed) {
+			    heap_error("Error:mem.c: Tree of large free blocks is broken\n");
+			    return -1;
+		    }
+		    listed += n;
+		    continue;
+	    }
+	    heapWord prev = 0;
+	    for (heapWord link = a->free_lists[cls]; link != 0; link = links_of(link_to_block(a, link))->next) {
+		    blockHeader *block = link_to_block(a, link);
+		    if (listed == freeBlocks || !listed_ok(a, block, cls) || links_of(block)->prev != prev) {
+			    heap_error("Error:mem.c: Free list %d is broken at %p\n", cls, (void*)block);
+			    return -1;
+		    }
+		    listed++;
+		    prev = link;
+	    }
+    }
+    if (listed != freeBlocks) {
+	    heap_error("Error:mem.c: Free lists hold %zu of the %zu free blocks\n", listed, freeBlocks);
+	    return -1;
+    }
+
+    size_t mappedBlocks = 0, mappedBytes = 0;
+    int mappedOk = 1;
+    mapped_lock();
+    for (size_t i = 0; mapped_mask != 0 && i <= mapped_mask; i++) {
+	    mappedBlock *mb = mapped_slots[i] ? (mappedBlock*)((char*)mapped_slots[i] - MAPPED_OFFSET) : NULL;
+	    if (mb != NULL && mb->owner == a) {
+		    // 5 while queued by remote_push()
+		    heapWord header = __atomic_load_n(&((blockHeader*)mapped_slots[i] - 1)->size_status, __ATOMIC_RELAXED);
+		    mappedOk &= header == 7 || header == 5;
+		    mappedBlocks++;
+		    mappedBytes += mb->length;
+	    }
+    }
+    mapped_unlock();
+    if (!mappedOk || mappedBlocks != a->stats.mapped_blocks || mappedBytes != a->stats.mapped_bytes) {
+	    heap_error("Error:mem.c: Mapped blocks do not match the counters\n");
+	    return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function for reading the default arena's statistics, see heap_read_stats().
+ * With HEAP_NUMA they are summed over the node arenas, and largest_free is
+ * the largest of theirs.
+ */
+int heap_stats(heapStats *stats) {
+    if (arena_stats(&default_arena, stats) != 0) {
+	    return -1;
+    }
+    for (int i = 1; i < num_nodes; i++) {
+	    heapStats nodeStats;
+	    if (node_arenas[i] == NULL || arena_stats(node_arenas[i], &nodeStats) != 0) {
+		    continue;
+	    }
+	    // every field is a size_t
+	    size_t *sum = (size_t*)stats;
+	    size_t *add = (size_t*)&nodeStats;
+	    for (size_t k = 0; k < sizeof(heapStats) / sizeof(size_t); k++) {
+		    sum[k] += add[k];
+	    }
+	    stats->largest_free -= nodeStats.largest_free;
+	    if (nodeStats.largest_free > stats->largest_free) {
+		    stats->largest_free = nodeStats.largest_free;
+	    }
+    }
+    return 0;
+}
+
+/*
+ * Function for checking the default arena, and the node arenas with
+ * HEAP_NUMA, see heap_validate().
+ * Returns 0 if all of them are consistent.
+ * Returns -1 if any is not.
+ */
+int heap_check(void) {
+    int ret = arena_check(&default_arena);
+    for (int i = 1; i < num_nodes; i++) {
+	    if (node_arenas[i] != NULL && arena_check(node_arenas[i]) != 0) {
+		    ret = -1;
+	    }
+    }
+    return ret;
+}
+
+/*
+ * Function for coalescing the default arena, and the node arenas with
+ * HEAP_NUMA, see heap_coalesce().
+ */
+int coalesce() {
+    int ret = arena_coalesce(&default_arena);
+    for (int i = 1; i < num_nodes; i++) {
+	    if (node_arenas[i] != NULL && arena_coalesce(node_arenas[i]) != 0) {
+		    ret = -1;
+	    }
+    }
+    return ret;
+}
+
+/*
+ * Function for coalescing part of the default arena, see heap_coalesce_step().
+ */
+size_t coalesce_step(size_t maxBlocks) {
+    return arena_coalesce_step(&default_arena, maxBlocks);
+}
+
+/*
+ * Functions for the handles of the default arena, see heap_balloc_handle(),
+ * heap_bfree_handle(), heap_handle_pin(), heap_handle_unpin() and
+ * heap_compact().
+ */
+heapHandle balloc_handle(size_t size) {
+    return arena_balloc_handle(&default_arena, size);
+}
+
+int bfree_handle(heapHandle h) {
+    return arena_bfree_handle(&default_arena, h);
+}
+
+void* handle_pin(heapHandle h) {
+    return arena_handle_pin(&default_arena, h);
+}
+
+int handle_unpin(heapHandle h) {
+    return arena_handle_unpin(&default_arena, h);
+}
+
+size_t compact() {
+    return arena_compact(&default_arena);
+}
+
+/*
+ * Function for placing the pages of a region on a NUMA node with mbind().
+ * The preferred policy lets pages come from other nodes when the node's
+ * memory runs out. It must be set before the pages are first touched;
+ * the part of the reservation made accessible later keeps it.
+ * Failing, e.g. on a kernel without NUMA support, leaves the default
+ * policy of allocating on the node of the first touch.
+ */
+static void bind_region(char *start, size_t size, int node) {
+#ifdef SYS_mbind
+    unsigned long mask[(HEAP_MAX_NODES + 63) / 64] = { 0 };
+    mask[node / 64] = 1UL << (node % 64);
+    // MPOL_PREFERRED, the kernel reads one bit less than maxnode
+    syscall(SYS_mbind, start, size, 1, mask, sizeof(mask) * 8 + 1, 0);
+#endif
+}
+
+/*
+ * Function for mapping a zero-filled region for a heap.
+ * Argument sizeOfRegion: the number of bytes needed, rounded up here
+ *   to a multiple of the page size.
+ * Argument flags: HEAP_HUGE_PAGES and HEAP_POPULATE, see their comment.
+ * Argument node: NUMA node to place the pages on, see bind_region(),
+ *   -1 for the default policy.
+ * Argument mapSize: set to the number of bytes mapped.
+ * Argument reserveSize: set to the number of bytes of address space
+ *   reserved for the heap to grow into, at least mapSize.
+ * Returns the start of the region on success.
+ * Returns NULL on failure.
+ */
+static char* map_region(size_t sizeOfRegion, int flags, int node, size_t *mapSize, size_t *reserveSize) {
+    size_t pagesize; // page size
+    size_t padsize;  // size of padding when heap size not a multiple of page size
+    size_t align;    // alignment of the reservation
+    void* mmap_ptr; // pointer to memory mapped area
+    int   fd;
+
+    if (sizeOfRegion > HEAP_MAX_SIZE) {
+	    heap_error("Error:mem.c: Requested block size is too large\n");
+	    return NULL;
+    }
+
+    // Get the pagesize from O.S. 
+    pagesize = getpagesize();
+
+    // Calculate padsize as the padding required to round up sizeOfRegion 
+    // to a multiple of pagesize
+    padsize = sizeOfRegion % pagesize;
+    padsize = (pagesize - padsize) % pagesize;
+
+    *mapSize = sizeOfRegion + padsize;
+    *reserveSize = HEAP_RESERVE_SIZE / pagesize * pagesize;
+    if (*reserveSize < *mapSize) {
+	    *reserveSize = *mapSize;
+    }
+
+#ifdef MAP_HUGETLB
+    if (flags & HEAP_HUGE_PAGES) {
+	    size_t hugeSize = (*mapSize + HEAP_HUGE_PAGE_SIZE - 1) / HEAP_HUGE_PAGE_SIZE * HEAP_HUGE_PAGE_SIZE;
+	    // a bound region is populated only once its policy is set
+	    int populate = (flags & HEAP_POPULATE) && node < 0 ? MAP_POPULATE : 0;
+	    mmap_ptr = mmap(NULL, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+	    // huge pages are reserved when mapped, so the heap cannot grow
+	    if (MAP_FAILED != mmap_ptr) {
+		    *mapSize = hugeSize;
+		    *reserveSize = hugeSize;
+		    if (node >= 0) {
+			    bind_region(mmap_ptr, hugeSize, node);
+			    if (flags & HEAP_POPULATE) {
+				    populate_pages(mmap_ptr, hugeSize);
+			    }
+		    }
+		    return mmap_ptr;
+	    }
+    }
+#endif
+    // transparent huge pages need huge page aligned memory
+    align = (flags & HEAP_HUGE_PAGES) ? HEAP_HUGE_PAGE_SIZE : 0;
+
+    // Using mmap to allocate memory
+    fd = open("/dev/zero", O_RDWR);
+    if (-1 == fd) {
+	    heap_error("Error:mem.c: Cannot open /dev/zero\n");
+	    return NULL;
+    }
+    // reserve address space to grow into, only the start is accessible
+    mmap_ptr = mmap(NULL, *reserveSize + align, PROT_NONE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    if (MAP_FAILED != mmap_ptr && align) {
+	    // unmap the unaligned head and the tail past the reservation
+	    char *aligned = (char*)(((unsigned long)mmap_ptr + align - 1) & ~(align - 1));
+	    if (aligned != (char*)mmap_ptr) {
+		    munmap(mmap_ptr, aligned - (char*)mmap_ptr);
+	    }
+	    munmap(aligned + *reserveSize, (char*)mmap_ptr + align - aligned);
+	    mmap_ptr = aligned;
+    }
+    if (MAP_FAILED != mmap_ptr && 0 != mprotect(mmap_ptr, *mapSize, PROT_READ | PROT_WRITE)) {
+	    munmap(mmap_ptr, *reserveSize);
+	    mmap_ptr = MAP_FAILED;
+    }
+    // without a reservation the heap cannot grow
+    if (MAP_FAILED == mmap_ptr) {
+	    *reserveSize = *mapSize;
+	    mmap_ptr = mmap(NULL, *mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (MAP_FAILED == mmap_ptr) {
+	    heap_error("Error:mem.c: mmap cannot allocate space\n");
+	    return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    // failing just leaves the heap on normal pages
+    if (flags & HEAP_HUGE_PAGES) {
+	    madvise(mmap_ptr, *reserveSize, MADV_HUGEPAGE);
+    }
+#endif
+    if (node >= 0) {
+	    bind_region(mmap_ptr, *reserveSize, node);
+    }
+    if (flags & HEAP_POPULATE) {
+	    populate_pages(mmap_ptr, *mapSize);
+    }
+    return mmap_ptr;
+}
+
+/*
+ * Function for setting up an arena over a freshly mapped region, whose
+ * blocks heap_format() or heap_recover() then set up.
+ * Argument start: offset of the first block header from base, chosen so
+ *   that payloads are aligned, see FIRST_BLOCK_OFFSET.
+ * A heap file has no slab runs and no mapped blocks, which would not
+ * survive a restart, and a shared heap has no block map either.
+ */
+static void arena_setup(arena *a, char *base, size_t mapSize, size_t reserveSize, size_t start, int flags) {
+    a->base = base;
+    a->flags = flags;
+    a->fd = -1;
+    a->corrupt = 0;
+    a->coalesce_next = NULL;
+    a->rover = NULL;
+    a->mmap_threshold = (flags & (HEAP_FILE | HEAP_SHARED)) ? 0 : HEAP_MMAP_THRESHOLD;
+    a->map_size = mapSize;
+    a->reserve_size = reserveSize;
+    // only the first block's header and links have been written to
+    a->trim_off = (start + sizeof(blockHeader) + sizeof(freeLinks) + getpagesize() - 1) / getpagesize() * getpagesize();
+    a->heap_start = (blockHeader*)(base + start);
+    // for double word alignment and end mark
+    a->alloc_size = mapSize - start - sizeof(blockHeader);
+    memset(a->free_lists, 0, sizeof(a->free_lists));
+    a->free_list_map = 0;
+    memset(a->slab_runs, 0, sizeof(a->slab_runs));
+    memset(&a->stats, 0, sizeof(a->stats));
+    a->handles = NULL;
+    a->handle_slots = 0;
+    a->handles_used = 0;
+    a->free_handle = 0;
+
+    a->slab_map = NULL;
+#ifndef HEAP_DEBUG
+    // one bit per slab run unit of the reservation, pages are only
+    // touched where runs are; without it every request gets a block,
+    // which the debug build needs for the canaries
+    size_t mapBytes = (reserveSize / SLAB_RUN_SIZE + 63) / 64 * 8;
+    if (!(flags & (HEAP_FILE | HEAP_SHARED))) {
+	    a->slab_map = mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+#endif
+    if (a->slab_map == MAP_FAILED) {
+	    a->slab_map = NULL;
+    }
+    // without it bfree falls back to the a-bit check alone
+    a->block_map = NULL;
+    if (!(flags & HEAP_SHARED)) {
+	    a->block_map = mmap(NULL, block_map_bytes(reserveSize), PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (a->block_map == MAP_FAILED) {
+	    a->block_map = NULL;
+    }
+#ifdef HEAP_THREAD_SAFE
+    a->queued_map = a->block_map != NULL ? a->block_map + block_map_bytes(reserveSize) / 16 : NULL;
+#endif
+}
+
+/*
+ * Function for writing the blocks of a new heap: initially there is only
+ * one big free block in the heap.
+ */
+static void heap_format(arena *a) {
+    blockHeader* end_mark;
+
+    // Set the end mark
+    end_mark = (blockHeader*)((char*)a->heap_start + a->alloc_size);
+    end_mark->size_status = 1;
+
+    // Set size in header
+    a->heap_start->size_status = a->alloc_size;
+
+    // Set p-bit as allocated in header
+    // note a-bit left at 0 for free
+    a->heap_start->size_status += 2;
+
+    // Set the footer
+    set_footer(a->heap_start, a->alloc_size);
+
+    // the whole heap starts out as one free block
+    free_list_insert(a, a->heap_start);
+}
+ 
+/*
+ * Function for counting the NUMA nodes from the kernel's list of online
+ * nodes, e.g. "0-1" or "0,2-3".
+ * Returns the highest node number + 1, at most HEAP_MAX_NODES, or 1 if
+ * the list cannot be read.
+ */
+static int numa_node_count(void) {
+    char list[256];
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    if (fd == -1) {
+	    return 1;
+    }
+    ssize_t len = read(fd, list, sizeof(list) - 1);
+    close(fd);
+    if (len <= 0) {
+	    return 1;
+    }
+    list[len] = '\0';
+
+    int nodes = 1;
+    for (char *p = list; *p != '\0'; ) {
+	    if (*p >= '0' && *p <= '9') {
+		    int node = (int)strtol(p, &p, 10);
+		    if (node + 1 > nodes) {
+			    nodes = node + 1;
+		    }
+	    } else {
+		    p++;
+	    }
+    }
+    return nodes < HEAP_MAX_NODES ? nodes : HEAP_MAX_NODES;
+}
+
+static int allocated_once = 0; //prevent multiple myInit calls
+
+/* 
+ * Function used to initialize the memory allocator.
+ * Intended to be called ONLY once by a program.
+ * In thread-safe mode it must return before other threads use the heap.
+ * Argument sizeOfRegion: the size of the heap space to be allocated.
+ *   The heap grows past it on demand, see HEAP_RESERVE_SIZE.
+ * Argument flags: 0 or HEAP_HUGE_PAGES and/or HEAP_POPULATE, see
+ *   HEAP_HUGE_PAGE_SIZE, and at most one of the placement policies
+ *   HEAP_GOOD_FIT and HEAP_NEXT_FIT, see HEAP_GOOD_FIT_SLACK.
+ *   HEAP_NUMA gives each NUMA node an arena of sizeOfRegion bytes, see
+ *   HEAP_MAX_NODES. HEAP_FILE and HEAP_SHARED are ignored, see
+ *   init_heap_file() and arena_open_shm().
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */                    
+int init_heap_flags(size_t sizeOfRegion, int flags) {    
+ 
+    void*  mmap_ptr; // pointer to memory mapped area
+    size_t map_size; // size of the mapped area
+    size_t reserve_size; // size of the reserved address space
+  
+    if (0 != allocated_once) {
+	    heap_error(
+	    "Error:mem.c: InitHeap has allocated space during a previous call\n");
+	    return -1;
+    }
+
+    if (sizeOfRegion == 0) {
+	    heap_error("Error:mem.c: Requested block size is not positive\n");
+	    return -1;
+    }
+
+    // only init_heap_file() maps a file
+    flags &= ~(HEAP_FILE | HEAP_SHARED);
+    int nodes = (flags & HEAP_NUMA) ? numa_node_count() : 1;
+    mmap_ptr = map_region(sizeOfRegion, flags, nodes > 1 ? 0 : -1, &map_size, &reserve_size);
+    if (NULL == mmap_ptr) {
+	    return -1;
+    }
+  
+    allocated_once = 1;
+
+    // Skip first header word for double word alignment requirement.
+    arena_setup(&default_arena, mmap_ptr, map_size, reserve_size, FIRST_BLOCK_OFFSET(0), flags);
+    heap_format(&default_arena);
+    heap_start = default_arena.heap_start;
+    alloc_size = default_arena.alloc_size;
+
+    // balloc falls back to the other nodes for a node without an arena
+    for (int node = 1; node < nodes; node++) {
+	    node_arenas[node] = arena_create_node(sizeOfRegion, flags, node);
+	    if (node_arenas[node] == NULL) {
+		    heap_error("Error:mem.c: Cannot create the arena of NUMA node %d\n", node);
+		    continue;
+	    }
+#ifdef HEAP_THREAD_SAFE
+	    // shared by every thread on the node like the default arena
+	    node_arenas[node]->has_owner = 0;
+#endif
+    }
+    num_nodes = nodes;
+  
+    return 0;
+} 
+
+/*
+ * Function for initializing the allocator with normal pages, see
+ * init_heap_flags().
+ */
+int init_heap(size_t sizeOfRegion) {
+    return init_heap_flags(sizeOfRegion, 0);
+}
+
+/*
+ * Function for checking the block chain of a heap file being attached,
+ * see init_heap_file(), or of a shared heap whose lock holder died. Every block must be a multiple of HEAP_ALIGNMENT
+ * of at least MIN_BLOCK_SIZE bytes inside the heap and the chain must end
+ * at the end mark. A p-bit that does not match the a-bit of the block
+ * before it is repaired: splits and merges write the header that covers
+ * their blocks last, see publish_header(), so a process that died halfway
+ * only leaves p-bits behind. The free lists, the block map and the
+ * counters are then rebuilt by coalescing, which also merges free blocks
+ * left next to each other by a process that died in bfree.
+ * Returns 0 on success.
+ * Returns -1 if the chain is broken.
+ */
+static int heap_recover(arena *a) {
+    char *end = (char*)a->heap_start + a->alloc_size;
+    blockHeader *current = a->heap_start;
+    size_t blocks = 0;
+    size_t prevAlloc = 1; // the first block's p-bit is set
+
+    while ((char*)current < end) {
+	    size_t size = current->size_status & ~3;
+	    if (size < MIN_BLOCK_SIZE || size % HEAP_ALIGNMENT != 0 || size > (size_t)(end - (char*)current)) {
+		    return -1;
+	    }
+	    if (((current->size_status >> 1) & 1) != prevAlloc) {
+		    current->size_status ^= 2;
+	    }
+	    prevAlloc = current->size_status & 1;
+	    if (prevAlloc) {
+		    block_map_set(a, current);
+#ifdef HEAP_DEBUG
+		    // a process that died in balloc may not have written it yet
+		    if (payload_size(current) == 0) {
+			    canary_set(current, size - sizeof(blockHeader) - HEAP_CANARY_SIZE);
+		    }
+#endif
+	    }
+	    blocks++;
+	    current = (blockHeader*)((char*)current + size);
+    }
+    if ((char*)current != end || (current->size_status & ~2) != 1) {
+	    return -1;
+    }
+    current->size_status = 1 | prevAlloc << 1;
+
+    // nothing is known about which pages are zero
+    a->trim_off = 0;
+    // as if the heap had been split into the blocks it has
+    a->stats.splits = blocks - 1;
+    a->stats.merges = 0;
+    a->stats.grows = 0;
+    return heap_coalesce(a);
+}
+
+/*
+ * Function for initializing the allocator over a heap file, so that the
+ * heap outlives the process. An empty or missing file gets a new heap,
+ * an existing one is attached again after heap_recover() has checked it.
+ * Attaching takes one walk over the blocks, their contents are not read.
+ * See arena_open_shm() for a heap shared by running processes instead.
+ *
+ * The file is mapped at the address it had before if that is free, so
+ * pointers stored in blocks stay valid. Otherwise only offsets from
+ * heap_root() do. Pages are written back by the kernel, heap_sync()
+ * forces it.
+ * Argument path: the file, created with mode 0600 if missing.
+ * Argument sizeOfRegion: the size of a new heap, ignored when attaching.
+ *   The heap and its file grow past it on demand like init_heap()'s.
+ * Argument flags: 0 or HEAP_POPULATE and/or a placement policy, see
+ *   init_heap_flags().
+ * Returns 0 on success.
+ * Returns -1 on failure, e.g. if the file is not a heap file of this
+ *   build or its block chain is broken.
+ */
+int init_heap_file(const char *path, size_t sizeOfRegion, int flags) {
+    if (0 != allocated_once) {
+	    heap_error("Error:mem.c: InitHeap has allocated space during a previous call\n");
+	    return -1;
+    }
+    if (path == NULL || (flags & ~(HEAP_POPULATE | HEAP_GOOD_FIT | HEAP_NEXT_FIT)) != 0) {
+	    heap_error("Error:mem.c: Invalid heap file arguments\n");
+	    return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+	    heap_error("Error:mem.c: Cannot open heap file %s\n", path);
+	    if (fd != -1) {
+		    close(fd);
+	    }
+	    return -1;
+    }
+
+    size_t pagesize = getpagesize();
+    size_t start = FIRST_BLOCK_OFFSET(FILE_HEADER_SIZE);
+    int attach = st.st_size != 0;
+    heapFile header;
+    size_t mapSize;
+    if (attach) {
+	    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+			    memcmp(header.magic, HEAP_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+			    header.version != HEAP_FILE_VERSION || header.word_size != sizeof(heapWord) ||
+			    header.alignment != HEAP_ALIGNMENT || header.map_size % pagesize != 0 ||
+			    header.map_size < start + MIN_BLOCK_SIZE + sizeof(blockHeader) ||
+			    header.map_size > (unsigned long long)st.st_size || header.map_size > HEAP_MAX_SIZE) {
+		    heap_error("Error:mem.c: %s is not a heap file of this build\n", path);
+		    close(fd);
+		    return -1;
+	    }
+	    mapSize = header.map_size;
+	    // a grow that died before it was recorded left pages past the
+	    // heap, new ones must read as zero
+	    if ((unsigned long long)st.st_size > mapSize && ftruncate(fd, mapSize) != 0) {
+		    close(fd);
+		    return -1;
+	    }
+    } else {
+	    if (sizeOfRegion == 0 || sizeOfRegion > HEAP_MAX_SIZE) {
+		    heap_error("Error:mem.c: Requested block size is not valid\n");
+		    close(fd);
+		    return -1;
+	    }
+	    mapSize = (sizeOfRegion + pagesize - 1) / pagesize * pagesize;
+	    if (mapSize < start + MIN_BLOCK_SIZE + sizeof(blockHeader)) {
+		    mapSize = (start + MIN_BLOCK_SIZE + sizeof(blockHeader) + pagesize - 1) / pagesize * pagesize;
+	    }
+	    if (ftruncate(fd, mapSize) != 0) {
+		    heap_error("Error:mem.c: Cannot size heap file %s\n", path);
+		    close(fd);
+		    return -1;
+	    }
+    }
+
+    // reserve address space to grow into like map_region(), the file is
+    // extended as the heap grows
+    void *hint = attach ? (void*)(unsigned long)header.address : NULL;
+    size_t reserveSize = HEAP_RESERVE_SIZE / pagesize * pagesize;
+    if (reserveSize < mapSize) {
+	    reserveSize = mapSize;
+    }
+    char *base = mmap(hint, reserveSize, PROT_NONE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (MAP_FAILED != base && 0 != mprotect(base, mapSize, PROT_READ | PROT_WRITE)) {
+	    munmap(base, reserveSize);
+	    base = MAP_FAILED;
+    }
+    if (MAP_FAILED == base) {
+	    reserveSize = mapSize;
+	    base = mmap(hint, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (MAP_FAILED == base) {
+	    heap_error("Error:mem.c: mmap cannot map heap file %s\n", path);
+	    close(fd);
+	    return -1;
+    }
+    if (flags & HEAP_POPULATE) {
+	    populate_pages(base, mapSize);
+    }
+
+    arena_setup(&default_arena, base, mapSize, reserveSize, start, flags | HEAP_FILE);
+    default_arena.fd = fd;
+    heapFile *file = (heapFile*)base;
+    if (attach) {
+	    if (heap_recover(&default_arena) != 0) {
+		    heap_error("Error:mem.c: Heap file %s is corrupt\n", path);
+		    if (default_arena.block_map != NULL) {
+			    munmap(default_arena.block_map, block_map_bytes(reserveSize));
+		    }
+		    munmap(base, reserveSize);
+		    close(fd);
+		    memset(&default_arena.stats, 0, sizeof(default_arena.stats));
+		    default_arena.base = NULL;
+		    default_arena.heap_start = NULL;
+		    default_arena.alloc_size = 0;
+		    default_arena.map_size = 0;
+		    default_arena.reserve_size = 0;
+		    default_arena.block_map = NULL;
+		    default_arena.fd = -1;
+		    return -1;
+	    }
+	    // a root that is no longer an allocated block is dropped
+	    if (file->root >= mapSize || ptr_to_block(&default_arena, base + file->root) == NULL) {
+		    file->root = 0;
+	    }
+    } else {
+	    heap_format(&default_arena);
+	    file->version = HEAP_FILE_VERSION;
+	    file->word_size = sizeof(heapWord);
+	    file->alignment = HEAP_ALIGNMENT;
+	    file->map_size = mapSize;
+	    file->root = 0;
+	    // a file whose heap was never fully written has no magic
+	    memcpy(file->magic, HEAP_FILE_MAGIC, sizeof(file->magic));
+    }
+    file->address = (unsigned long)base;
+
+    allocated_once = 1;
+    heap_start = default_arena.heap_start;
+    alloc_size = default_arena.alloc_size;
+    return 0;
+}
+
+/*
+ * Function for finding the root block of a heap file, the block a
+ * restarted process finds its data from.
+ * Returns the root's payload, NULL if none was set or the heap is not
+ * a heap file.
+ */
+void* heap_root(void) {
+    if (!(default_arena.flags & HEAP_FILE)) {
+	    return NULL;
+    }
+    heapFile *file = (heapFile*)default_arena.base;
+    return file->root != 0 ? default_arena.base + file->root : NULL;
+}
+
+/*
+ * Function for setting the root block of a heap file, see heap_root().
+ * Argument ptr: an allocated block of the heap, NULL for none.
+ * Returns 0 on success.
+ * Returns -1 if the heap is not a heap file or ptr is not a block of it.
+ */
+int heap_set_root(void *ptr) {
+    if (!(default_arena.flags & HEAP_FILE)) {
+	    return -1;
+    }
+    arena_lock(&default_arena);
+    if (ptr != NULL && ptr_to_block(&default_arena, ptr) == NULL) {
+	    arena_unlock(&default_arena);
+	    return -1;
+    }
+    ((heapFile*)default_arena.base)->root = ptr != NULL ? (char*)ptr - default_arena.base : 0;
+    arena_unlock(&default_arena);
+    return 0;
+}
+
+/*
+ * Function for writing a heap file's pages back to the file.
+ * Returns 0 on success.
+ * Returns -1 if the heap is not a heap file or msync fails.
+ */
+int heap_sync(void) {
+    if (!(default_arena.flags & HEAP_FILE)) {
+	    return -1;
+    }
+    arena_lock(&default_arena);
+    size_t mapSize = default_arena.map_size;
+    arena_unlock(&default_arena);
+    return msync(default_arena.base, mapSize, MS_SYNC) == 0 ? 0 : -1;
+}
+
+/*
+ * Shared heaps, see arena_open_shm().
+ *
+ * A shared heap is an arena in a POSIX shared memory object that several
+ * processes map at the same address: a heapFile header, the arena struct
+ * and the blocks. Its pointers, free lists and counters are therefore
+ * valid in each of them, and a block allocated by one process can be
+ * freed by another. The arena lock is process-shared and robust. The
+ * heap does not grow and has no slab runs, mapped blocks, block map or
+ * handles, which would be private to one process.
+ */
+#define HEAP_SHM_MAGIC     "p4hshm1"
+#define SHM_ATTACH_TRIES   1000   // ms to wait for the creator to finish
+#ifndef HEAP_MAX_SHM
+#define HEAP_MAX_SHM       16     // shared heaps a process can have open
+#endif
+
+#ifdef HEAP_THREAD_SAFE
+/* The shared heaps mapped in this process, also those inherited through
+ * fork(), NULL for unused slots.
+ */
+static arena *shm_arenas[HEAP_MAX_SHM];
+static pthread_mutex_t shm_arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Function for creating a shared heap in the new, empty object fd.
+ * Returns the arena on success.
+ * Returns NULL on failure.
+ */
+static arena* shm_create(int fd, size_t sizeOfRegion) {
+    size_t pagesize = getpagesize();
+    size_t start = FIRST_BLOCK_OFFSET(FILE_HEADER_SIZE + ARENA_HEADER_SIZE);
+    if (sizeOfRegion == 0 || sizeOfRegion > HEAP_MAX_SIZE - start - pagesize) {
+	    heap_error("Error:mem.c: Requested block size is not valid\n");
+	    return NULL;
+    }
+    size_t mapSize = (start + sizeOfRegion + pagesize - 1) / pagesize * pagesize;
+    if (ftruncate(fd, mapSize) != 0) {
+	    heap_error("Error:mem.c: Cannot size shared heap\n");
+	    return NULL;
+    }
+    char *base = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == base) {
+	    heap_error("Error:mem.c: mmap cannot allocate space\n");
+	    return NULL;
+    }
+
+    arena *a = (arena*)(base + FILE_HEADER_SIZE);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&a->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    a->has_owner = 0;
+    a->remote_frees = NULL;
+    arena_setup(a, base, mapSize, mapSize, start, HEAP_SHARED);
+    heap_format(a);
+
+    heapFile *file = (heapFile*)base;
+    file->version = HEAP_FILE_VERSION;
+    file->word_size = sizeof(heapWord);
+    file->alignment = HEAP_ALIGNMENT;
+    file->arena_size = sizeof(arena);
+    file->map_size = mapSize;
+    file->root = 0;
+    file->address = (unsigned long)base;
+    // attaching processes wait for the magic
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(file->magic, HEAP_SHM_MAGIC, sizeof(file->magic));
+    return a;
+}
+
+/*
+ * Function for attaching the shared heap in the object fd, waiting up to
+ * SHM_ATTACH_TRIES ms for its creator to set it up.
+ * Returns the arena on success.
+ * Returns NULL if it is not a shared heap of this build or its address is
+ *   taken in this process by anything but the heap itself.
+ */
+static arena* shm_attach(int fd) {
+    heapFile header;
+    struct stat st;
+    int ready = 0;
+    for (int i = 0; i < SHM_ATTACH_TRIES && !ready; i++) {
+	    ready = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(header) &&
+			    pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+			    memcmp(header.magic, HEAP_SHM_MAGIC, sizeof(header.magic)) == 0;
+	    if (!ready) {
+		    struct timespec ms = { 0, 1000000 };
+		    nanosleep(&ms, NULL);
+	    }
+    }
+    if (!ready || header.version != HEAP_FILE_VERSION || header.word_size != sizeof(heapWord) ||
+		    header.alignment != HEAP_ALIGNMENT || header.arena_size != sizeof(arena) ||
+		    header.map_size != (unsigned long long)st.st_size) {
+	    heap_error("Error:mem.c: Not a shared heap of this build\n");
+	    return NULL;
+    }
+
+    void *address = (void*)(unsigned long)header.address;
+    for (int i = 0; i < HEAP_MAX_SHM; i++) {
+	    if (shm_arenas[i] != NULL && shm_arenas[i]->base == (char*)address) {
+		    return shm_arenas[i];
+	    }
+    }
+#ifdef MAP_FIXED_NOREPLACE
+    int fixed = MAP_FIXED_NOREPLACE;
+#else
+    int fixed = 0;
+#endif
+    char *base = mmap(address, header.map_size, PROT_READ | PROT_WRITE, MAP_SHARED | fixed, fd, 0);
+    if (MAP_FAILED != base && base != address) {
+	    munmap(base, header.map_size);
+	    base = MAP_FAILED;
+    }
+    if (MAP_FAILED == base) {
+	    heap_error("Error:mem.c: Cannot map shared heap at %p\n", address);
+	    return NULL;
+    }
+    return (arena*)(base + FILE_HEADER_SIZE);
+}
+#endif
+
+/*
+ * Function for opening a shared heap, creating it if it does not exist.
+ * Every process that opens it can allocate and free its blocks with the
+ * arena_* functions, and the pointers are the same in all of them.
+ * Opening a heap that is already mapped in the process, also through
+ * fork(), returns its arena. At most HEAP_MAX_SHM can be open at once.
+ * Needs thread-safe mode. On glibc before 2.34 link with -lrt.
+ *
+ * A process that dies holding the lock leaves the next one to take it
+ * the task of checking the blocks and rebuilding the free lists, see
+ * heap_recover(); blocks it had allocated stay allocated. If the blocks
+ * cannot be repaired the heap is marked corrupt for every process: from
+ * then on arena_balloc() returns NULL, arena_bfree() and arena_check()
+ * return -1.
+ * Argument name: the shm_open() name, e.g. "/cache".
+ * Argument sizeOfRegion: the size of a new heap, ignored when attaching.
+ *   A shared heap does not grow.
+ * Returns the arena on success.
+ * Returns NULL on failure.
+ */
+arena* arena_open_shm(const char *name, size_t sizeOfRegion) {
+#ifndef HEAP_THREAD_SAFE
+    (void)name;
+    (void)sizeOfRegion;
+    heap_error("Error:mem.c: Shared heaps need HEAP_THREAD_SAFE\n");
+    return NULL;
+#else
+    if (name == NULL) {
+	    return NULL;
+    }
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    int created = fd != -1;
+    if (fd == -1 && errno == EEXIST) {
+	    fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd == -1) {
+	    heap_error("Error:mem.c: Cannot open shared heap %s\n", name);
+	    return NULL;
+    }
+    pthread_mutex_lock(&shm_arenas_lock);
+    int slot = 0;
+    while (slot < HEAP_MAX_SHM && shm_arenas[slot] != NULL) {
+	    slot++;
+    }
+    arena *a = NULL;
+    if (slot == HEAP_MAX_SHM) {
+	    heap_error("Error:mem.c: Too many shared heaps open\n");
+    } else {
+	    a = created ? shm_create(fd, sizeOfRegion) : shm_attach(fd);
+    }
+    if (a != NULL) {
+	    // an already open heap keeps its slot
+	    int open = 0;
+	    for (int i = 0; i < HEAP_MAX_SHM; i++) {
+		    open |= shm_arenas[i] == a;
+	    }
+	    if (!open) {
+		    shm_arenas[slot] = a;
+	    }
+    }
+    pthread_mutex_unlock(&shm_arenas_lock);
+    // a heap that could not be set up is not left for others to wait on
+    if (a == NULL && created) {
+	    shm_unlink(name);
+    }
+    close(fd);
+    return a;
+#endif
+}
+
+/*
+ * Function for unmapping a shared heap from the calling process. The heap
+ * and its blocks stay for the other processes, shm_unlink() its name to
+ * remove it once all have closed it.
+ * Returns 0 on success.
+ * Returns -1 if a is not a shared heap.
+ */
+int arena_close_shm(arena *a) {
+    if (a == NULL || !(a->flags & HEAP_SHARED)) {
+	    return -1;
+    }
+#ifdef HEAP_THREAD_SAFE
+    pthread_mutex_lock(&shm_arenas_lock);
+    for (int i = 0; i < HEAP_MAX_SHM; i++) {
+	    if (shm_arenas[i] == a) {
+		    shm_arenas[i] = NULL;
+	    }
+    }
+    pthread_mutex_unlock(&shm_arenas_lock);
+#endif
+    return munmap(a->base, a->map_size);
+}
+
+/*
+ * Function for creating a new independent arena whose pages are placed
+ * on a NUMA node, see bind_region().
+ * Argument sizeOfRegion: the size of the heap space to be allocated.
+ * Argument flags: as for init_heap_flags(), HEAP_NUMA, HEAP_FILE and
+ *   HEAP_SHARED are ignored.
+ * Argument node: the node, -1 for the default policy.
+ * Returns the new arena on success.
+ * Returns NULL on failure.
+ */
+arena* arena_create_node(size_t sizeOfRegion, int flags, int node) {
+    char  *base;
+    size_t map_size;
+    size_t reserve_size;
+
+    if (sizeOfRegion == 0) {
+	    heap_error("Error:mem.c: Requested block size is not positive\n");
+	    return NULL;
+    }
+    if (node < -1 || node >= HEAP_MAX_NODES) {
+	    heap_error("Error:mem.c: NUMA node %d is out of range\n", node);
+	    return NULL;
+    }
+
+    // the arena struct goes in front of the heap space
+    flags &= ~(HEAP_FILE | HEAP_SHARED);
+    base = map_region(sizeOfRegion + ARENA_HEADER_SIZE, flags, node, &map_size, &reserve_size);
+    if (NULL == base) {
+	    return NULL;
+    }
+
+    arena *a = (arena*)base;
+#ifdef HEAP_THREAD_SAFE
+    pthread_mutex_init(&a->lock, NULL);
+    a->owner = pthread_self();
+    a->has_owner = 1;
+    a->remote_frees = NULL;
+#endif
+    // skip one more header word for double word alignment requirement
+    arena_setup(a, base, map_size, reserve_size, FIRST_BLOCK_OFFSET(ARENA_HEADER_SIZE), flags);
+    heap_format(a);
+    return a;
+}
+
+/*
+ * Function for creating a new independent arena, see arena_create_node().
+ */
+arena* arena_create_flags(size_t sizeOfRegion, int flags) {
+    return arena_create_node(sizeOfRegion, flags, -1);
+}
+
+/*
+ * Function for creating an arena with normal pages, see arena_create_flags().
+ */
+arena* arena_create(size_t sizeOfRegion) {
+    return arena_create_flags(sizeOfRegion, 0);
+}
+
+/*
+ * Function for destroying an arena made by arena_create(), giving its
+ * whole region back to the O.S. Every block in it becomes invalid.
+ * Returns 0 on success.
+ * Returns -1 if a is NULL, the default arena, a node arena or a shared
+ *   heap, see arena_close_shm(), or munmap fails.
+ */
+int arena_destroy(arena *a) {
+    if (a == NULL || a == &default_arena || (a->flags & HEAP_SHARED)) {
+	    return -1;
+    }
+    for (int i = 1; i < num_nodes; i++) {
+	    if (a == node_arenas[i]) {
+		    return -1;
+	    }
+    }
+
+    unmap_all(a);
+#ifdef HEAP_THREAD_SAFE
+    pthread_mutex_destroy(&a->lock);
+#endif
+    if (a->slab_map != NULL) {
+	    munmap(a->slab_map, (a->reserve_size / SLAB_RUN_SIZE + 63) / 64 * 8);
+    }
+    if (a->block_map != NULL) {
+	    munmap(a->block_map, block_map_bytes(a->reserve_size));
+    }
+    if (a->handles != NULL) {
+	    munmap(a->handles, a->handle_slots * sizeof(handleEntry));
+    }
+    return munmap(a->base, a->reserve_size);
+}
+
+/*
+ * Function for making the calling thread the owner of a, see
+ * remote_push(). An arena starts out owned by the thread that created it.
+ * No other thread may free blocks of a meanwhile.
+ * Returns 0 on success.
+ * Returns -1 if a is NULL, the default arena or a shared heap, which
+ *   have no owner.
+ */
+int arena_set_owner(arena *a) {
+    if (a == NULL || a == &default_arena || (a->flags & HEAP_SHARED)) {
+	    return -1;
+    }
+#ifdef HEAP_THREAD_SAFE
+    arena_lock(a);
+    remote_drain(a);
+    a->owner = pthread_self();
+    arena_unlock(a);
+#endif
+    return 0;
+}
+
+/*
+ * Function for setting the request size from which blocks of a get a
+ * mapping of their own, see map_block(). Blocks already allocated stay
+ * where they are.
+ * Argument threshold: the size in bytes, 0 to never map blocks.
+ * Returns 0 on success.
+ * Returns -1 if a is NULL.
+ */
+int arena_set_mmap_threshold(arena *a, size_t threshold) {
+    if (a == NULL) {
+	    return -1;
+    }
+    arena_lock(a);
+    a->mmap_threshold = threshold;
+    arena_unlock(a);
+    return 0;
+}
+
+/*
+ * Function for setting the mmap threshold of the default arena, and of
+ * the node arenas with HEAP_NUMA, see arena_set_mmap_threshold().
+ */
+int heap_set_mmap_threshold(size_t threshold) {
+    int ret = 0;
+    for (int i = 0; i < num_nodes; i++) {
+	    if (node_arenas[i] != NULL && arena_set_mmap_threshold(node_arenas[i], threshold) != 0) {
+		    ret = -1;
+	    }
+    }
+    return ret;
+}
+
+/*
+ * Function for allocating 'size' bytes from an arena, see heap_balloc().
+ */
+void* arena_balloc(arena *a, size_t size) {
+    arena_lock(a);
+    remote_drain(a);
+    void *ptr = heap_balloc(a, size);
+    arena_unlock(a);
+    return ptr;
+}
+
+/*
+ * Function for allocating aligned memory from an arena, see
+ * heap_balloc_aligned().
+ */
+void* arena_balloc_aligned(arena *a, size_t size, size_t align) {
+    arena_lock(a);
+    remote_drain(a);
+    void *ptr = heap_balloc_aligned(a, size, align);
+    arena_unlock(a);
+    return ptr;
+}
+
+/*
+ * Function for allocating a zeroed array from an arena, see heap_bcalloc().
+ */
+void* arena_bcalloc(arena *a, size_t n, size_t size) {
+    arena_lock(a);
+    remote_drain(a);
+    void *ptr = heap_bcalloc(a, n, size);
+    arena_unlock(a);
+    return ptr;
+}
+
+/*
+ * Function for allocating count blocks from an arena, see heap_balloc_batch().
+ */
+size_t arena_balloc_batch(arena *a, size_t size, size_t count, void **out) {
+    arena_lock(a);
+    remote_drain(a);
+    size_t n = heap_balloc_batch(a, size, count, out);
+    arena_unlock(a);
+    return n;
+}
+
+/*
+ * Function for freeing n blocks of an arena, see heap_bfree_batch().
+ */
+int arena_bfree_batch(arena *a, void **ptrs, size_t n) {
+#ifdef HEAP_THREAD_SAFE
+    if (is_remote(a)) {
+	    int ret = 0;
+	    for (size_t i = 0; i < n; i++) {
+		    if (remote_push(a, ptrs[i]) != 0) {
+			    ret = -1;
+		    }
+	    }
+	    return ret;
+    }
+#endif
+    arena_lock(a);
+    int ret = heap_bfree_batch(a, ptrs, n);
+    arena_unlock(a);
+    return ret;
+}
+
+/*
+ * Function for resizing a block of an arena, see heap_brealloc().
+ */
+void* arena_brealloc(arena *a, void *ptr, size_t size) {
+    arena_lock(a);
+    remote_drain(a);
+    void *newPtr = heap_brealloc(a, ptr, size);
+    arena_unlock(a);
+    return newPtr;
+}
+
+/*
+ * Function for freeing up a block allocated from an arena, see heap_bfree().
+ *
+ * In thread-safe mode a thread other than the arena's owner checks ptr
+ * without the lock and queues it, see remote_push().
+ */
+int arena_bfree(arena *a, void *ptr) {
+#ifdef HEAP_THREAD_SAFE
+    if (is_remote(a)) {
+	    return remote_push(a, ptr);
+    }
+#endif
+    arena_lock(a);
+    int ret = heap_bfree(a, ptr);
+    arena_unlock(a);
+    return ret;
+}
 
-    // Calculate padsize as the padding required to round up sizeOfRegion 
-    // to a multiple of pagesize
-    padsize = sizeOfRegion % pagesize;
-    padsize = (pagesize - padsize) % pagesize;
+/*
+ * Function for allocating a movable block from an arena, see
+ * heap_balloc_handle().
+ */
+heapHandle arena_balloc_handle(arena *a, size_t size) {
+    arena_lock(a);
+    remote_drain(a);
+    heapHandle h = heap_balloc_handle(a, size);
+    arena_unlock(a);
+    return h;
+}
 
-    alloc_size = sizeOfRegion + padsize;
+/*
+ * Function for freeing a handle of an arena, see heap_bfree_handle().
+ */
+int arena_bfree_handle(arena *a, heapHandle h) {
+    arena_lock(a);
+    int ret = heap_bfree_handle(a, h);
+    arena_unlock(a);
+    return ret;
+}
 
-    // Using mmap to allocate memory
-    fd = open("/dev/zero", O_RDWR);
-    if (-1 == fd) {
-        fprintf(stderr, "Error:mem.c: Cannot open /dev/zero\n");
-        return -1;
-    }
-    mmap_ptr = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    if (MAP_FAILED == mmap_ptr) {
-        fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
-        allocated_once = 0;
-        return -1;
-    }
-  
-    allocated_once = 1;
+/*
+ * Function for pinning a handle of an arena, see heap_handle_pin().
+ */
+void* arena_handle_pin(arena *a, heapHandle h) {
+    arena_lock(a);
+    void *ptr = heap_handle_pin(a, h);
+    arena_unlock(a);
+    return ptr;
+}
 
-    // for double word alignment and end mark
-    alloc_size -= 8;
+/*
+ * Function for unpinning a handle of an arena, see heap_handle_unpin().
+ */
+int arena_handle_unpin(arena *a, heapHandle h) {
+    arena_lock(a);
+    int ret = heap_handle_unpin(a, h);
+    arena_unlock(a);
+    return ret;
+}
 
-    // Initially there is only one big free block in the heap.
-    // Skip first 4 bytes for double word alignment requirement.
-    heap_start = (blockHeader*) mmap_ptr + 1;
+/*
+ * Function for compacting an arena, see heap_compact().
+ */
+size_t arena_compact(arena *a) {
+    arena_lock(a);
+    remote_drain(a);
+    size_t top = heap_compact(a);
+    arena_unlock(a);
+    return top;
+}
 
-    // Set the end mark
-    end_mark = (blockHeader*)((void*)heap_start + alloc_size);
-    end_mark->size_status = 1;
+/*
+ * Function for coalescing an arena, see heap_coalesce().
+ */
+int arena_coalesce(arena *a) {
+    arena_lock(a);
+    remote_drain(a);
+    int ret = heap_coalesce(a);
+    arena_unlock(a);
+    return ret;
+}
 
-    // Set size in header
-    heap_start->size_status = alloc_size;
+/*
+ * Function for reading an arena's statistics, see heap_read_stats().
+ */
+int arena_stats(arena *a, heapStats *stats) {
+    arena_lock(a);
+    remote_drain(a);
+    int ret = heap_read_stats(a, stats);
+    arena_unlock(a);
+    return ret;
+}
 
-    // Set p-bit as allocated in header
-    // note a-bit left at 0 for free
-    heap_start->size_status += 2;
+/*
+ * Function for checking an arena, see heap_validate().
+ */
+int arena_check(arena *a) {
+    arena_lock(a);
+    remote_drain(a);
+    int ret = heap_validate(a);
+    arena_unlock(a);
+    return ret;
+}
 
-    // Set the footer
-    blockHeader *footer = (blockHeader*) ((void*)heap_start + alloc_size - 4);
-    footer->size_status = alloc_size;
-  
-    return 0;
-} 
+/*
+ * Function for coalescing part of an arena, see heap_coalesce_step().
+ */
+size_t arena_coalesce_step(arena *a, size_t maxBlocks) {
+    arena_lock(a);
+    remote_drain(a);
+    size_t merged = heap_coalesce_step(a, maxBlocks);
+    arena_unlock(a);
+    return merged;
+}
                   
 /* 
  * Function can be used for DEBUGGING to help you visualize your heap structure.
@@ -316,21 +5356,28 @@ int init_heap(int sizeOfRegion) {
  * t_Begin  : address of the first byte in the block (where the header starts) 
  * t_End    : address of the last byte in the block 
  * t_Size   : size of the block as stored in the block header
+ *
+ * Argument a: the arena to display.
+ * In thread-safe mode the caller must hold the arena lock.
  */                     
-void disp_heap() {     
+static void heap_disp(arena *a) {
  
     int    counter;
     char   status[6];
     char   p_status[6];
     char * t_begin = NULL;
     char * t_end   = NULL;
-    int    t_size;
+    size_t t_size;
 
-    blockHeader *current = heap_start;
+    if (a->corrupt) {
+	    fprintf(stdout, "The shared heap is corrupt\n");
+	    return;
+    }
+    blockHeader *current = a->heap_start;
     counter = 1;
 
-    int used_size =  0;
-    int free_size =  0;
+    size_t used_size =  0;
+    size_t free_size =  0;
     int is_used   = -1;
 
     fprintf(stdout, 
@@ -339,7 +5386,7 @@ void disp_heap() {
     fprintf(stdout, 
 	"---------------------------------------------------------------------------------\n");
   
-    while (current->size_status != 1) {
+    while (!is_end_mark(current)) {
         t_begin = (char*)current;
         t_size = current->size_status;
     
@@ -367,7 +5414,7 @@ void disp_heap() {
 
         t_end = t_begin + t_size - 1;
     
-        fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%4i\n", counter, status, 
+	    fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%4zu\n", counter, status, 
         p_status, (unsigned long int)t_begin, (unsigned long int)t_end, t_size);
     
         current = (blockHeader*)((char*)current + t_size);
@@ -378,9 +5425,9 @@ void disp_heap() {
 	"---------------------------------------------------------------------------------\n");
     fprintf(stdout, 
 	"*********************************************************************************\n");
-    fprintf(stdout, "Total used size = %4d\n", used_size);
-    fprintf(stdout, "Total free size = %4d\n", free_size);
-    fprintf(stdout, "Total size      = %4d\n", used_size + free_size);
+    fprintf(stdout, "Total used size = %4zu\n", used_size);
+    fprintf(stdout, "Total free size = %4zu\n", free_size);
+    fprintf(stdout, "Total size      = %4zu\n", used_size + free_size);
     fprintf(stdout, 
 	"*********************************************************************************\n");
     fflush(stdout);
@@ -388,7 +5435,548 @@ void disp_heap() {
     return;  
 } 
 
+/*
+ * Function for displaying the default arena, see heap_disp().
+ */
+void disp_heap() {
+    arena_disp_heap(&default_arena);
+}
+
+/*
+ * Function for displaying an arena, see heap_disp().
+ */
+void arena_disp_heap(arena *a) {
+    arena_lock(a);
+    remote_drain(a);
+    heap_disp(a);
+    arena_unlock(a);
+}
+
+/*
+ * Buckets of the heap_report() histograms, bucket i counts sizes from
+ * 2^i up to 2^(i+1) - 1 bytes. Sizes are at least 8, so buckets 0-2
+ * stay empty and are left out.
+ */
+#define REPORT_FIRST_BUCKET 3
+#define REPORT_BUCKETS      48
+
+static int size_bucket(size_t size) {
+    int bucket = 63 - __builtin_clzll((unsigned long long)size);
+    return bucket < REPORT_BUCKETS ? bucket : REPORT_BUCKETS - 1;
+}
+
+/*
+ * Function for writing one machine-readable report record for an arena.
+ * Traverses heap blocks like heap_disp() but only collects:
+ * - a histogram of free block sizes
+ * - a histogram of allocated sizes, counting each slab object in use
+ *   by its object size instead of its run
+ * - the external fragmentation, 1 - largest free block / free bytes
+ * - the padding added to requests by rounding, see count_request()
+ * - the blocks with a mapping of their own and their bytes
+ * Argument format: HEAP_REPORT_JSON writes one line of JSON.
+ *   HEAP_REPORT_CSV writes one CSV line, HEAP_REPORT_CSV_HEADER the line
+ *   with the column names for it.
+ * Returns 0 on success.
+ * Returns -1 if out or format is invalid or writing fails.
+ *
+ * Argument a: the arena to report on.
+ * In thread-safe mode the caller must hold the arena lock.
+ */
+static int heap_write_report(arena *a, FILE *out, int format) {
+    size_t freeHist[REPORT_BUCKETS] = {0};
+    size_t allocHist[REPORT_BUCKETS] = {0};
+    heapStats stats;
+
+    if (out == NULL || a->corrupt || heap_read_stats(a, &stats) != 0) {
+	    return -1;
+    }
+
+    if (format == HEAP_REPORT_CSV_HEADER) {
+	    fprintf(out, "heap_size,bytes_in_use,bytes_free,largest_free,fragmentation,requested_bytes,padding_bytes,"
+			    "mapped_blocks,mapped_bytes");
+	    for (int i = REPORT_FIRST_BUCKET; i < REPORT_BUCKETS; i++) {
+		    fprintf(out, ",free_%llu", 1ULL << i);
+	    }
+	    for (int i = REPORT_FIRST_BUCKET; i < REPORT_BUCKETS; i++) {
+		    fprintf(out, ",alloc_%llu", 1ULL << i);
+	    }
+	    fprintf(out, "\n");
+	    return ferror(out) ? -1 : 0;
+    }
+    if (format != HEAP_REPORT_JSON && format != HEAP_REPORT_CSV) {
+	    return -1;
+    }
+
+    blockHeader *current = a->heap_start;
+    while (current != NULL && !is_end_mark(current)) {
+	    size_t size = current->size_status & ~3;
+	    slabRun *run;
+
+	    if (!(current->size_status & 1)) {
+		    freeHist[size_bucket(size)]++;
+	    } else if ((run = slab_run_of(a, current + 1)) != NULL) {
+		    allocHist[size_bucket(run->obj_size)] += run->nobjs - run->nfree;
+	    } else {
+		    allocHist[size_bucket(size)]++;
+	    }
+	    current = (blockHeader*)((char*)current + size);
+    }
+
+    double fragmentation = 0;
+    if (stats.bytes_free > 0) {
+	    fragmentation = 1 - (double)stats.largest_free / stats.bytes_free;
+    }
+
+    if (format == HEAP_REPORT_CSV) {
+	    fprintf(out, "%zu,%zu,%zu,%zu,%.4f,%zu,%zu,%zu,%zu", stats.heap_size, stats.bytes_in_use,
+			    stats.bytes_free, stats.largest_free, fragmentation, stats.requested_bytes, stats.padding_bytes,
+			    stats.mapped_blocks, stats.mapped_bytes);
+	    for (int i = REPORT_FIRST_BUCKET; i < REPORT_BUCKETS; i++) {
+		    fprintf(out, ",%zu", freeHist[i]);
+	    }
+	    for (int i = REPORT_FIRST_BUCKET; i < REPORT_BUCKETS; i++) {
+		    fprintf(out, ",%zu", allocHist[i]);
+	    }
+	    fprintf(out, "\n");
+	    return ferror(out) ? -1 : 0;
+    }
+
+    // JSON histograms only list the non-empty buckets, keyed by lower bound
+    fprintf(out, "{\"heap_size\":%zu,\"bytes_in_use\":%zu,\"bytes_free\":%zu,\"largest_free\":%zu,"
+		    "\"fragmentation\":%.4f,\"requested_bytes\":%zu,\"padding_bytes\":%zu,"
+		    "\"mapped_blocks\":%zu,\"mapped_bytes\":%zu,\"free_hist\":{",
+		    stats.heap_size, stats.bytes_in_use, stats.bytes_free, stats.largest_free, fragmentation,
+		    stats.requested_bytes, stats.padding_bytes, stats.mapped_blocks, stats.mapped_bytes);
+    const char *sep = "";
+    for (int i = REPORT_FIRST_BUCKET; i < REPORT_BUCKETS; i++) {
+	    if (freeHist[i]) {
+		    fprintf(out, "%s\"%llu\":%zu", sep, 1ULL << i, freeHist[i]);
+		    sep = ",";
+	    }
+    }
+    fprintf(out, "},\"alloc_hist\":{");
+    sep = "";
+    for (int i = REPORT_FIRST_BUCKET; i < REPORT_BUCKETS; i++) {
+	    if (allocHist[i]) {
+		    fprintf(out, "%s\"%llu\":%zu", sep, 1ULL << i, allocHist[i]);
+		    sep = ",";
+	    }
+    }
+    fprintf(out, "}}\n");
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+ * Function for reporting on the default arena, see heap_write_report().
+ */
+int heap_report(FILE *out, int format) {
+    return arena_report(&default_arena, out, format);
+}
+
+/*
+ * Function for reporting on an arena, see heap_write_report().
+ */
+int arena_report(arena *a, FILE *out, int format) {
+    arena_lock(a);
+    remote_drain(a);
+    int ret = heap_write_report(a, out, format);
+    arena_unlock(a);
+    return ret;
+}
+
 
                                        
 
 
+
+/*
+ * Bump regions.
+ *
+ * A bump region hands out pieces of one large block with a pointer bump:
+ * pieces have no headers and cannot be freed one by one, region_reset()
+ * frees all of them at once. It suits objects that die together, e.g.
+ * everything allocated for one request. The block is allocated and freed
+ * like any other, so it shows up in heap_stats() as one used block, or
+ * as one mapped block if the capacity reaches the mmap threshold.
+ *
+ * The heapRegion struct sits at the start of its block, the pieces follow.
+ * Pieces are aligned like balloc's payloads, see HEAP_ALIGNMENT.
+ */
+struct heapRegion {
+    char *next;                 // start of the next piece
+    char *end;                  // end of the block's payload
+    arena *from;                // arena of the block, NULL for the default
+};
+
+#define REGION_HEADER_SIZE ((sizeof(heapRegion) + HEAP_ALIGNMENT - 1) / HEAP_ALIGNMENT * HEAP_ALIGNMENT)
+
+/*
+ * Function for setting up a bump region in a freshly allocated block.
+ * Returns r, NULL if the block could not be allocated.
+ */
+static heapRegion* region_setup(heapRegion *r, size_t capacity, arena *a) {
+    if (r == NULL) {
+	    return NULL;
+    }
+    r->next = (char*)r + REGION_HEADER_SIZE;
+    r->end = r->next + capacity;
+    r->from = a;
+    return r;
+}
+
+/*
+ * Function for making a bump region from a block of the default arena.
+ * Argument capacity: bytes of pieces the region can hold, rounded up here
+ *   to a multiple of HEAP_ALIGNMENT.
+ * Returns the region on success.
+ * Returns NULL if capacity is 0 or too large, or the heap has no space.
+ */
+heapRegion* region_begin(size_t capacity) {
+    if (capacity < 1 || capacity > HEAP_MAX_SIZE - REGION_HEADER_SIZE) {
+	    return NULL;
+    }
+    capacity = (capacity + HEAP_ALIGNMENT - 1) & ~(size_t)(HEAP_ALIGNMENT - 1);
+    return region_setup(balloc(REGION_HEADER_SIZE + capacity), capacity, NULL);
+}
+
+/*
+ * Function for making a bump region from a block of an arena, see
+ * region_begin().
+ */
+heapRegion* arena_region_begin(arena *a, size_t capacity) {
+    if (capacity < 1 || capacity > HEAP_MAX_SIZE - REGION_HEADER_SIZE) {
+	    return NULL;
+    }
+    capacity = (capacity + HEAP_ALIGNMENT - 1) & ~(size_t)(HEAP_ALIGNMENT - 1);
+    return region_setup(arena_balloc(a, REGION_HEADER_SIZE + capacity), capacity, a);
+}
+
+/*
+ * Function for allocating n bytes from a bump region.
+ * Takes no lock, a region must only be used by one thread at a time.
+ * Returns the address of the piece on success.
+ * Returns NULL if n is 0 or the region has less than n bytes left.
+ */
+void* region_alloc(heapRegion *r, size_t n) {
+    if (n < 1 || n > (size_t)(r->end - r->next)) {
+	    return NULL;
+    }
+    // next and end stay aligned, so this cannot pass end
+    void *ptr = r->next;
+    r->next += (n + HEAP_ALIGNMENT - 1) & ~(size_t)(HEAP_ALIGNMENT - 1);
+    return ptr;
+}
+
+/*
+ * Function for freeing every piece of a bump region at once. The region
+ * can be used again right away.
+ */
+void region_reset(heapRegion *r) {
+    r->next = (char*)r + REGION_HEADER_SIZE;
+}
+
+/*
+ * Function for freeing a bump region's block, and so all its pieces.
+ * Returns 0 on success.
+ * Returns -1 if r is NULL or bfree fails on its block.
+ */
+int region_end(heapRegion *r) {
+    if (r == NULL) {
+	    return -1;
+    }
+    if (r->from != NULL) {
+	    return arena_bfree(r->from, r);
+    }
+    return bfree(r);
+}
+
+#ifdef HEAP_MALLOC_SHIM
+#ifndef HEAP_THREAD_SAFE
+#error "HEAP_MALLOC_SHIM needs HEAP_THREAD_SAFE"
+#endif
+/*
+ * malloc shim.
+ *
+ * Built with -DHEAP_MALLOC_SHIM this file also defines malloc, free,
+ * calloc, realloc, reallocarray, posix_memalign, aligned_alloc, memalign,
+ * valloc, pvalloc and malloc_usable_size on top of balloc and bfree, so
+ * that the heap can stand in for the C library's allocator:
+ *
+ *   make libp4heap.so
+ *   LD_PRELOAD=./libp4heap.so program
+ *
+ * The Makefile's rule builds it with -fPIC -shared
+ * -ftls-model=initial-exec -DHEAP_THREAD_SAFE -DHEAP_MALLOC_SHIM -pthread.
+ *
+ * The first call sets up the heap with HEAP_SHIM_SIZE bytes, it grows
+ * from there. Setting up takes no lock but a pthread_once and does not
+ * print anything, see heap_error(). Payloads are 16-byte aligned like
+ * malloc's, see HEAP_ALIGNMENT.
+ *
+ * Requests the heap cannot serve, such as ones larger than its whole
+ * reservation, get a mapping of their own that free() unmaps. Such a
+ * block has a mappedChunk in front of it and is told apart from heap
+ * blocks by its address.
+ *
+ * fork() takes every arena lock first, so a child of a threaded program
+ * finds the heap unlocked.
+ */
+#ifndef HEAP_SHIM_SIZE
+#define HEAP_SHIM_SIZE ((size_t)1 << 20)
+#endif
+
+typedef struct mappedChunk {
+    size_t offset;              // from the start of the mapping to the block
+    size_t length;              // bytes mapped
+} mappedChunk;
+
+static pthread_once_t shim_once = PTHREAD_ONCE_INIT;
+static int shim_state;          // 1 once the heap is set up, -1 if it failed
+static int shim_forking;        // 1 once the fork handlers are registered
+
+static void shim_fork_prepare(void) {
+    for (int i = 0; i < num_nodes; i++) {
+	    if (node_arenas[i] != NULL) {
+		    arena_lock(node_arenas[i]);
+	    }
+    }
+}
+
+static void shim_fork_release(void) {
+    for (int i = num_nodes - 1; i >= 0; i--) {
+	    if (node_arenas[i] != NULL) {
+		    arena_unlock(node_arenas[i]);
+	    }
+    }
+}
+
+static void shim_init(void) {
+    __atomic_store_n(&shim_state, init_heap(HEAP_SHIM_SIZE) == 0 ? 1 : -1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function for setting up the heap on the first call.
+ * Returns 1 if the heap can be used, 0 if it could not be set up.
+ */
+static int shim_start(void) {
+    int state = __atomic_load_n(&shim_state, __ATOMIC_ACQUIRE);
+    if (state != 0) {
+	    return state > 0;
+    }
+    pthread_once(&shim_once, shim_init);
+    if (__atomic_load_n(&shim_state, __ATOMIC_ACQUIRE) < 0) {
+	    return 0;
+    }
+    // pthread_atfork can call malloc, which finds the heap ready by now
+    if (!__atomic_exchange_n(&shim_forking, 1, __ATOMIC_ACQ_REL)) {
+	    pthread_atfork(shim_fork_prepare, shim_fork_release, shim_fork_release);
+    }
+    return 1;
+}
+
+/*
+ * Function for telling heap blocks from the shim's own mapped ones.
+ * Returns 1 if ptr is in the reservation of a node arena or is one of
+ * their mapped blocks.
+ */
+static int shim_owns(void *ptr) {
+    return arena_holding(ptr) != NULL;
+}
+
+/*
+ * Function for mapping a block of its own for 'size' bytes aligned to
+ * align, a power of two.
+ * Returns the block on success.
+ * Returns NULL, with errno set to ENOMEM, on failure.
+ */
+static void* shim_map(size_t size, size_t align) {
+    size_t pagesize = getpagesize();
+    if (align < HEAP_ALIGNMENT) {
+	    align = HEAP_ALIGNMENT;
+    }
+    if (size > ~(size_t)0 - sizeof(mappedChunk) - align - pagesize) {
+	    errno = ENOMEM;
+	    return NULL;
+    }
+    size_t length = (size + sizeof(mappedChunk) + align + pagesize - 1) / pagesize * pagesize;
+    char *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+	    errno = ENOMEM;
+	    return NULL;
+    }
+    char *ptr = (char*)(((unsigned long)base + sizeof(mappedChunk) + align - 1) & ~(unsigned long)(align - 1));
+    mappedChunk *chunk = (mappedChunk*)ptr - 1;
+    chunk->offset = ptr - base;
+    chunk->length = length;
+    return ptr;
+}
+
+/*
+ * Function for finding the usable bytes of a block from malloc().
+ */
+static size_t shim_usable_size(void *ptr) {
+    if (!shim_owns(ptr)) {
+	    mappedChunk *chunk = (mappedChunk*)ptr - 1;
+	    return chunk->length - chunk->offset;
+    }
+    arena *a = arena_of(ptr);
+    arena_lock(a);
+    size_t size = usable_size(a, ptr);
+    arena_unlock(a);
+    return size;
+}
+
+/*
+ * Function for malloc() itself. The other calls use it rather than malloc,
+ * which the compiler may turn a malloc and memset into a call to calloc.
+ */
+static void* shim_alloc(size_t size) {
+    // malloc(0) returns a block that can be freed
+    if (size == 0) {
+	    size = 1;
+    }
+    if (shim_start()) {
+	    void *ptr = balloc(size);
+	    if (ptr != NULL) {
+		    return ptr;
+	    }
+    }
+    return shim_map(size, HEAP_ALIGNMENT);
+}
+
+void* malloc(size_t size) {
+    return shim_alloc(size);
+}
+
+void free(void *ptr) {
+    if (ptr == NULL) {
+	    return;
+    }
+    if (shim_owns(ptr)) {
+	    bfree(ptr);
+	    return;
+    }
+    mappedChunk *chunk = (mappedChunk*)ptr - 1;
+    munmap((char*)ptr - chunk->offset, chunk->length);
+}
+
+void* calloc(size_t count, size_t size) {
+    if (size != 0 && count > ~(size_t)0 / size) {
+	    errno = ENOMEM;
+	    return NULL;
+    }
+    void *ptr = count * size != 0 && shim_start() ? bcalloc(count, size) : NULL;
+    if (ptr != NULL) {
+	    return ptr;
+    }
+    ptr = shim_alloc(count * size);
+    // mapped blocks are zero already
+    if (ptr != NULL && shim_owns(ptr)) {
+	    memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void* realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+	    return shim_alloc(size);
+    }
+    if (size == 0) {
+	    free(ptr);
+	    return NULL;
+    }
+    if (shim_owns(ptr)) {
+	    void *newPtr = brealloc(ptr, size);
+	    if (newPtr != NULL) {
+		    return newPtr;
+	    }
+    }
+
+    // a mapped block, or no arena has space for it
+    size_t oldSize = shim_usable_size(ptr);
+    if (oldSize == 0) {
+	    errno = ENOMEM;
+	    return NULL;
+    }
+    if (!shim_owns(ptr) && size <= oldSize) {
+	    return ptr;
+    }
+    void *newPtr = shim_owns(ptr) ? shim_map(size, HEAP_ALIGNMENT) : shim_alloc(size);
+    if (newPtr == NULL) {
+	    return NULL;
+    }
+    memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+    free(ptr);
+    return newPtr;
+}
+
+void* reallocarray(void *ptr, size_t count, size_t size) {
+    if (size != 0 && count > ~(size_t)0 / size) {
+	    errno = ENOMEM;
+	    return NULL;
+    }
+    return realloc(ptr, count * size);
+}
+
+/*
+ * Function for the aligned allocation calls.
+ * Returns NULL, with errno set, on failure.
+ */
+static void* shim_aligned(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+	    errno = EINVAL;
+	    return NULL;
+    }
+    if (size == 0) {
+	    size = 1;
+    }
+    if (shim_start()) {
+	    void *ptr = balloc_aligned(size, align);
+	    if (ptr != NULL) {
+		    return ptr;
+	    }
+    }
+    return shim_map(size, align);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size) {
+    if (align % sizeof(void*) != 0) {
+	    return EINVAL;
+    }
+    int saved = errno;
+    void *ptr = shim_aligned(align, size);
+    if (ptr == NULL) {
+	    int err = errno;
+	    errno = saved;
+	    return err;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t align, size_t size) {
+    return shim_aligned(align, size);
+}
+
+void* memalign(size_t align, size_t size) {
+    return shim_aligned(align, size);
+}
+
+void* valloc(size_t size) {
+    return shim_aligned(getpagesize(), size);
+}
+
+void* pvalloc(size_t size) {
+    size_t pagesize = getpagesize();
+    if (size > ~(size_t)0 - pagesize) {
+	    errno = ENOMEM;
+	    return NULL;
+    }
+    return shim_aligned(pagesize, (size + pagesize - 1) / pagesize * pagesize);
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return ptr == NULL ? 0 : shim_usable_size(ptr);
+}
+#endif
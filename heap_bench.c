@@ -0,0 +1,334 @@
+/*
+ * Allocation latency benchmark.
+ *
+ * Drives the heap and glibc malloc with the same traces and reports, per
+ * trace and allocator, throughput, p50/p99/p999 latency of single calls
+ * and the peak heap utilization (most live payload bytes at once divided
+ * by the heap size at that moment). Every trace and allocator pair runs in
+ * its own child process so that each starts from a fresh heap, and the
+ * heap starts small and grows on demand like malloc's does.
+ *
+ * The heap runs once per placement policy: best fit (heap), HEAP_GOOD_FIT
+ * (heap-good) and HEAP_NEXT_FIT (heap-next).
+ *
+ * Traces:
+ *   uniform    sizes 16-128, random alloc/free with about 4096 live blocks
+ *   bimodal    90% sizes 16-256, 10% 4 KiB-64 KiB
+ *   prodcons   FIFO: blocks are freed in the order they were allocated
+ *   realloc    random resizes of 256 buffers between 16 bytes and 64 KiB
+ *
+ * Build and run:
+ *   gcc -O2 -o heap_bench heap_bench.c Dynamic_Mem_Alloc.c
+ *   ./heap_bench [ops] [seed]
+ * Add -DHEAP_THREAD_SAFE -pthread to measure thread-safe mode.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "p4Heap.h"
+
+#define HEAP_SIZE  (256 << 10)
+#define MAX_LIVE   4096
+
+/*
+ * An allocator under test.
+ */
+typedef struct allocator {
+    const char *name;
+    void* (*alloc)(size_t size);
+    int   (*release)(void *ptr);
+    void* (*resize)(void *ptr, size_t size);
+    size_t (*heap_size)(void);
+    int flags;                  // init_heap_flags() flags of the heap
+} allocator;
+
+static size_t heap_heap_size(void) {
+    heapStats stats;
+    heap_stats(&stats);
+    return stats.heap_size;
+}
+
+static int libc_free(void *ptr) {
+    free(ptr);
+    return 0;
+}
+
+static size_t libc_heap_size(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static const allocator allocators[] = {
+    { "heap",      balloc, bfree,     brealloc, heap_heap_size, 0 },
+    { "heap-good", balloc, bfree,     brealloc, heap_heap_size, HEAP_GOOD_FIT },
+    { "heap-next", balloc, bfree,     brealloc, heap_heap_size, HEAP_NEXT_FIT },
+    { "malloc",    malloc, libc_free, realloc,  libc_heap_size, 0 },
+};
+
+/*
+ * Per run measurements.
+ */
+typedef struct run {
+    const allocator *alloc;
+    long long *latency;  // ns per call
+    size_t calls;
+    size_t live_bytes;
+    size_t peak_live;
+    double peak_util;
+    unsigned int seed;
+} run;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Function for updating the live byte count and the peak utilization.
+ * The heap size is only sampled at new peaks of live bytes.
+ */
+static void track_live(run *r, long long delta) {
+    r->live_bytes += delta;
+    if (r->live_bytes > r->peak_live) {
+	    r->peak_live = r->live_bytes;
+	    size_t heapSize = r->alloc->heap_size();
+	    if (heapSize > 0 && (double)r->live_bytes / heapSize > r->peak_util) {
+		    r->peak_util = (double)r->live_bytes / heapSize;
+	    }
+    }
+}
+
+static void* timed_alloc(run *r, size_t size) {
+    long long start = now_ns();
+    void *ptr = r->alloc->alloc(size);
+    r->latency[r->calls++] = now_ns() - start;
+    if (ptr == NULL) {
+	    fprintf(stderr, "%s: allocation of %zu bytes failed\n", r->alloc->name, size);
+	    exit(1);
+    }
+    // touch the block like a real user would
+    memset(ptr, 0, size < 64 ? size : 64);
+    track_live(r, size);
+    return ptr;
+}
+
+static void timed_free(run *r, void *ptr, size_t size) {
+    long long start = now_ns();
+    r->alloc->release(ptr);
+    r->latency[r->calls++] = now_ns() - start;
+    track_live(r, -(long long)size);
+}
+
+static void* timed_resize(run *r, void *ptr, size_t oldSize, size_t size) {
+    long long start = now_ns();
+    void *newPtr = r->alloc->resize(ptr, size);
+    r->latency[r->calls++] = now_ns() - start;
+    if (newPtr == NULL) {
+	    fprintf(stderr, "%s: resize to %zu bytes failed\n", r->alloc->name, size);
+	    exit(1);
+    }
+    track_live(r, (long long)size - (long long)oldSize);
+    return newPtr;
+}
+
+static size_t rand_size(run *r, size_t lo, size_t hi) {
+    return lo + rand_r(&r->seed) % (hi - lo + 1);
+}
+
+/*
+ * Traces. Each makes about ops calls and frees everything it allocated.
+ */
+static void trace_random(run *r, size_t ops, int bimodal) {
+    static void *ptrs[MAX_LIVE];
+    static size_t sizes[MAX_LIVE];
+
+    memset(ptrs, 0, sizeof(ptrs));
+    while (r->calls < ops) {
+	    int i = rand_r(&r->seed) % MAX_LIVE;
+	    if (ptrs[i] != NULL) {
+		    timed_free(r, ptrs[i], sizes[i]);
+		    ptrs[i] = NULL;
+	    } else {
+		    if (bimodal && rand_r(&r->seed) % 10 == 0) {
+			    sizes[i] = rand_size(r, 4096, 65536);
+		    } else {
+			    sizes[i] = rand_size(r, 16, bimodal ? 256 : 128);
+		    }
+		    ptrs[i] = timed_alloc(r, sizes[i]);
+	    }
+    }
+    for (int i = 0; i < MAX_LIVE; i++) {
+	    if (ptrs[i] != NULL) {
+		    timed_free(r, ptrs[i], sizes[i]);
+	    }
+    }
+}
+
+static void trace_uniform(run *r, size_t ops) {
+    trace_random(r, ops, 0);
+}
+
+static void trace_bimodal(run *r, size_t ops) {
+    trace_random(r, ops, 1);
+}
+
+static void trace_prodcons(run *r, size_t ops) {
+    static void *queue[MAX_LIVE];
+    static size_t sizes[MAX_LIVE];
+    size_t head = 0, tail = 0;
+
+    while (r->calls < ops) {
+	    // the producer runs ahead in bursts, the consumer catches up
+	    int burst = 1 + rand_r(&r->seed) % 64;
+	    for (int i = 0; i < burst && tail - head < MAX_LIVE; i++) {
+		    sizes[tail % MAX_LIVE] = rand_size(r, 32, 2048);
+		    queue[tail % MAX_LIVE] = timed_alloc(r, sizes[tail % MAX_LIVE]);
+		    tail++;
+	    }
+	    burst = 1 + rand_r(&r->seed) % 64;
+	    for (int i = 0; i < burst && head < tail; i++) {
+		    timed_free(r, queue[head % MAX_LIVE], sizes[head % MAX_LIVE]);
+		    head++;
+	    }
+    }
+    while (head < tail) {
+	    timed_free(r, queue[head % MAX_LIVE], sizes[head % MAX_LIVE]);
+	    head++;
+    }
+}
+
+static void trace_realloc(run *r, size_t ops) {
+    enum { BUFFERS = 256 };
+    static void *bufs[BUFFERS];
+    static size_t sizes[BUFFERS];
+
+    for (int i = 0; i < BUFFERS; i++) {
+	    sizes[i] = 16;
+	    bufs[i] = timed_alloc(r, sizes[i]);
+    }
+    while (r->calls < ops) {
+	    int i = rand_r(&r->seed) % BUFFERS;
+	    // mostly appends, sometimes a buffer is cut back
+	    size_t size = sizes[i] + rand_size(r, 16, 1024);
+	    if (size > 65536 || rand_r(&r->seed) % 8 == 0) {
+		    size = rand_size(r, 16, 512);
+	    }
+	    bufs[i] = timed_resize(r, bufs[i], sizes[i], size);
+	    sizes[i] = size;
+    }
+    for (int i = 0; i < BUFFERS; i++) {
+	    timed_free(r, bufs[i], sizes[i]);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*drive)(run *r, size_t ops);
+} traces[] = {
+    { "uniform",  trace_uniform },
+    { "bimodal",  trace_bimodal },
+    { "prodcons", trace_prodcons },
+    { "realloc",  trace_realloc },
+};
+
+static int compare_latency(const void *p1, const void *p2) {
+    long long l1 = *(const long long*)p1;
+    long long l2 = *(const long long*)p2;
+    return l1 < l2 ? -1 : l1 > l2;
+}
+
+/*
+ * Function for finding the latency below which a fraction p of the calls
+ * stayed. Returns 0 if there were no calls.
+ */
+static long long percentile(run *r, double p) {
+    if (r->calls == 0) {
+	    return 0;
+    }
+    return r->latency[(size_t)(p * (r->calls - 1))];
+}
+
+/*
+ * Function for running one trace against one allocator and printing its
+ * result line. Runs in a child process.
+ */
+static int bench_one(size_t t, size_t k, size_t ops, unsigned int seed) {
+    if (allocators[k].alloc == balloc && init_heap_flags(HEAP_SIZE, allocators[k].flags) != 0) {
+	    return 1;
+    }
+    // traces finish their last frees past ops; mapped so that it does not
+    // count against either allocator's heap size
+    size_t latencySize = (ops + 2 * MAX_LIVE) * sizeof(long long);
+    long long *latency = mmap(NULL, latencySize, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (latency == MAP_FAILED) {
+	    return 1;
+    }
+    run r = { .alloc = &allocators[k], .latency = latency, .seed = seed };
+
+    long long start = now_ns();
+    traces[t].drive(&r, ops);
+    long long elapsed = now_ns() - start;
+
+    // the heap's own defragmentation pass, malloc has none
+    long long coalesceTime = 0;
+    if (allocators[k].alloc == balloc) {
+	    start = now_ns();
+	    coalesce();
+	    coalesceTime = now_ns() - start;
+    }
+
+    qsort(r.latency, r.calls, sizeof(long long), compare_latency);
+    printf("%-9s %-9s %12.0f %8lld %8lld %8lld %8.1f%% %11.1f\n",
+	    traces[t].name, allocators[k].name, r.calls * 1e9 / elapsed,
+	    percentile(&r, 0.5), percentile(&r, 0.99), percentile(&r, 0.999),
+	    100 * r.peak_util, coalesceTime / 1e3);
+    munmap(latency, latencySize);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t ops = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    unsigned int seed = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+    int failed = 0;
+
+    if (ops == 0) {
+	    fprintf(stderr, "usage: %s [ops] [seed], ops at least 1\n", argv[0]);
+	    return 2;
+    }
+
+    printf("%-9s %-9s %12s %8s %8s %8s %9s %11s\n",
+	    "trace", "alloc", "ops/s", "p50 ns", "p99 ns", "p999 ns", "peak util", "coalesce us");
+    fflush(stdout);
+    for (size_t t = 0; t < sizeof(traces) / sizeof(traces[0]); t++) {
+	    for (size_t k = 0; k < sizeof(allocators) / sizeof(allocators[0]); k++) {
+		    pid_t pid = fork();
+		    if (pid < 0) {
+			    perror("fork");
+			    return 1;
+		    }
+		    if (pid == 0) {
+			    int rc = bench_one(t, k, ops, seed);
+			    fflush(stdout);
+			    _exit(rc);
+		    }
+		    int status;
+		    waitpid(pid, &status, 0);
+		    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			    fprintf(stderr, "%s/%s failed\n", traces[t].name, allocators[k].name);
+			    failed = 1;
+		    }
+	    }
+    }
+    return failed;
+}
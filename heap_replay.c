@@ -0,0 +1,253 @@
+/*
+ * Allocation trace replay.
+ *
+ * Replays a trace written by heap_trace_start() against a fresh heap of
+ * the size the traced heap had when the trace started, then reports how
+ * long the replay took and how fragmented the heap got.
+ *
+ * The records of all threads are merged in time order and replayed by one
+ * thread. Blocks are matched up by their offset in the traced heap; frees
+ * of blocks allocated before the trace started are skipped.
+ *
+ * Build and run:
+ *   gcc -O2 -o heap_replay heap_replay.c Dynamic_Mem_Alloc.c
+ *   ./heap_replay trace-file
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "p4Heap.h"
+
+/*
+ * Open addressing table from block offsets in the trace to the blocks
+ * allocated by the replay.
+ */
+typedef struct liveBlock {
+    unsigned long long offset;  // HEAP_TRACE_NULL if the slot is empty
+    void *ptr;
+} liveBlock;
+
+typedef struct liveTable {
+    liveBlock *slots;
+    size_t mask;
+    size_t count;
+} liveTable;
+
+static size_t slot_of(liveTable *t, unsigned long long offset) {
+    size_t i = (size_t)((offset >> 3) * 0x9E3779B97F4A7C15ULL) & t->mask;
+    while (t->slots[i].offset != HEAP_TRACE_NULL && t->slots[i].offset != offset) {
+	    i = (i + 1) & t->mask;
+    }
+    return i;
+}
+
+static void table_init(liveTable *t, size_t slots) {
+    t->slots = malloc(slots * sizeof(liveBlock));
+    if (t->slots == NULL) {
+	    fprintf(stderr, "Out of memory\n");
+	    exit(1);
+    }
+    for (size_t i = 0; i < slots; i++) {
+	    t->slots[i].offset = HEAP_TRACE_NULL;
+    }
+    t->mask = slots - 1;
+    t->count = 0;
+}
+
+static void table_put(liveTable *t, unsigned long long offset, void *ptr) {
+    if (offset == HEAP_TRACE_NULL) {
+	    return;
+    }
+    if (2 * (t->count + 1) > t->mask + 1) {
+	    liveTable bigger;
+	    table_init(&bigger, 2 * (t->mask + 1));
+	    for (size_t i = 0; i <= t->mask; i++) {
+		    if (t->slots[i].offset != HEAP_TRACE_NULL) {
+			    bigger.slots[slot_of(&bigger, t->slots[i].offset)] = t->slots[i];
+			    bigger.count++;
+		    }
+	    }
+	    free(t->slots);
+	    *t = bigger;
+    }
+    size_t i = slot_of(t, offset);
+    if (t->slots[i].offset == HEAP_TRACE_NULL) {
+	    t->count++;
+    }
+    t->slots[i].offset = offset;
+    t->slots[i].ptr = ptr;
+}
+
+/*
+ * Function for removing offset from the table.
+ * Returns the replayed block, NULL if offset is not in the table.
+ */
+static void* table_take(liveTable *t, unsigned long long offset) {
+    if (offset == HEAP_TRACE_NULL) {
+	    return NULL;
+    }
+    size_t i = slot_of(t, offset);
+    if (t->slots[i].offset == HEAP_TRACE_NULL) {
+	    return NULL;
+    }
+    void *ptr = t->slots[i].ptr;
+
+    // backward shift deletion keeps every probe sequence unbroken
+    size_t hole = i;
+    for (size_t j = (i + 1) & t->mask; t->slots[j].offset != HEAP_TRACE_NULL; j = (j + 1) & t->mask) {
+	    size_t home = (size_t)((t->slots[j].offset >> 3) * 0x9E3779B97F4A7C15ULL) & t->mask;
+	    if (((j - home) & t->mask) >= ((j - hole) & t->mask)) {
+		    t->slots[hole] = t->slots[j];
+		    hole = j;
+	    }
+    }
+    t->slots[hole].offset = HEAP_TRACE_NULL;
+    t->count--;
+    return ptr;
+}
+
+/*
+ * Function for ordering records by time. Records are sorted through an
+ * array of pointers so their file position can break ties, which keeps
+ * the order of a thread's records with the same timestamp.
+ */
+static int compare_records(const void *p1, const void *p2) {
+    const heapTraceRecord *r1 = *(heapTraceRecord* const*)p1;
+    const heapTraceRecord *r2 = *(heapTraceRecord* const*)p2;
+    if (r1->time != r2->time) {
+	    return r1->time < r2->time ? -1 : 1;
+    }
+    return r1 < r2 ? -1 : r1 > r2;
+}
+
+static double fragmentation_of(heapStats *stats) {
+    if (stats->bytes_free == 0) {
+	    return 0;
+    }
+    return 1 - (double)stats->largest_free / stats->bytes_free;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+	    fprintf(stderr, "usage: %s trace-file\n", argv[0]);
+	    return 2;
+    }
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL) {
+	    perror(argv[1]);
+	    return 1;
+    }
+
+    heapTraceHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+		    memcmp(header.magic, HEAP_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+		    header.record_size != sizeof(heapTraceRecord)) {
+	    fprintf(stderr, "%s: not a heap trace of this build\n", argv[1]);
+	    return 1;
+    }
+
+    size_t count = 0, capacity = 1 << 16;
+    heapTraceRecord *records = malloc(capacity * sizeof(heapTraceRecord));
+    while (records != NULL) {
+	    count += fread(records + count, sizeof(heapTraceRecord), capacity - count, in);
+	    if (count < capacity) {
+		    break;
+	    }
+	    capacity *= 2;
+	    records = realloc(records, capacity * sizeof(heapTraceRecord));
+    }
+    fclose(in);
+    heapTraceRecord **order = records != NULL ? malloc(count * sizeof(heapTraceRecord*) + 1) : NULL;
+    if (order == NULL) {
+	    fprintf(stderr, "Out of memory\n");
+	    return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+	    order[i] = &records[i];
+    }
+    qsort(order, count, sizeof(heapTraceRecord*), compare_records);
+
+    if (init_heap(header.heap_size) != 0) {
+	    return 1;
+    }
+    liveTable live;
+    table_init(&live, 1 << 12);
+
+    heapStats stats;
+    size_t failed = 0, skipped = 0;
+    size_t peakInUse = 0;
+    double peakFragmentation = 0;
+    long long elapsed = 0;
+
+    for (size_t i = 0; i < count; i++) {
+	    heapTraceRecord *rec = order[i];
+	    void *ptr;
+	    long long start = now_ns();
+
+	    switch (rec->op) {
+	    case HEAP_TRACE_BALLOC:
+		    ptr = balloc(rec->size);
+		    break;
+	    case HEAP_TRACE_ALIGNED:
+		    ptr = balloc_aligned(rec->size, rec->arg);
+		    break;
+	    case HEAP_TRACE_REALLOC:
+		    // a failed brealloc left the old block as it was
+		    if (rec->offset == HEAP_TRACE_NULL) {
+			    continue;
+		    }
+		    ptr = table_take(&live, rec->arg);
+		    if (ptr == NULL && rec->arg != HEAP_TRACE_NULL) {
+			    skipped++;
+			    continue;
+		    }
+		    ptr = brealloc(ptr, rec->size);
+		    break;
+	    case HEAP_TRACE_BFREE:
+		    ptr = table_take(&live, rec->offset);
+		    if (ptr == NULL) {
+			    skipped++;
+			    continue;
+		    }
+		    bfree(ptr);
+		    elapsed += now_ns() - start;
+		    continue;
+	    default:
+		    fprintf(stderr, "%s: bad record %zu\n", argv[1], i);
+		    return 1;
+	    }
+	    elapsed += now_ns() - start;
+
+	    if (ptr == NULL && rec->offset != HEAP_TRACE_NULL) {
+		    failed++;
+	    }
+	    if (ptr != NULL) {
+		    table_put(&live, rec->offset, ptr);
+	    }
+
+	    // sample the heap at new peaks of bytes in use
+	    heap_stats(&stats);
+	    if (stats.bytes_in_use > peakInUse) {
+		    peakInUse = stats.bytes_in_use;
+		    peakFragmentation = fragmentation_of(&stats);
+	    }
+    }
+
+    heap_stats(&stats);
+    printf("records         %zu\n", count);
+    printf("skipped         %zu  (blocks from before the trace)\n", skipped);
+    printf("failed allocs   %zu  (succeeded when traced)\n", failed);
+    printf("replay time     %.3f ms, %.1f ns/op\n", elapsed / 1e6,
+	    count > 0 ? (double)elapsed / count : 0.0);
+    printf("peak in use     %zu bytes, fragmentation %.4f\n", peakInUse, peakFragmentation);
+    printf("final heap      %zu bytes, %zu in use, fragmentation %.4f\n",
+	    stats.heap_size, stats.bytes_in_use, fragmentation_of(&stats));
+    return 0;
+}
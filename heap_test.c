@@ -0,0 +1,234 @@
+/*
+ * Pointer validation test.
+ *
+ * Frees pointers that bfree must reject without touching the heap:
+ * foreign pointers, interior pointers, double frees of every kind of
+ * block, and the same from a thread that does not own the arena, whose
+ * frees go on the remote free queue. The heap is checked with
+ * heap_check() or arena_check() after each case. Also checks that
+ * balloc_batch fills free blocks before it grows the heap.
+ *
+ * Build and run:
+ *   make test
+ * which builds with -DHEAP_DEBUG -DHEAP_THREAD_SAFE -pthread. The remote
+ * free cases need thread-safe mode and are skipped without it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HEAP_THREAD_SAFE
+#include <pthread.h>
+#endif
+#include "p4Heap.h"
+
+#define HEAP_SIZE  (1 << 20)
+#define BIG_SIZE   (4 << 20)   // past the mmap threshold
+#define HOLE_SIZE  600
+#define HOLES      150
+
+static int failures = 0;
+
+/*
+ * Function for recording the outcome of one check.
+ */
+static void expect(int ok, const char *what) {
+    if (!ok) {
+	    fprintf(stderr, "FAIL: %s\n", what);
+	    failures++;
+    }
+}
+
+/*
+ * Function for checking the default arena after a case.
+ */
+static void expect_heap_ok(const char *test) {
+    if (heap_check() != 0) {
+	    fprintf(stderr, "FAIL: %s: heap_check\n", test);
+	    failures++;
+    }
+}
+
+/*
+ * Pointers that never came from the heap.
+ */
+static void test_foreign(void) {
+    int local;
+    char *block = balloc(300);
+    char *libc = malloc(64);
+
+    expect(bfree(NULL) == -1, "foreign: NULL");
+    expect(bfree(&local) == -1, "foreign: stack address");
+    expect(bfree(libc) == -1, "foreign: malloc'd block");
+    expect(bfree(block + 1) == -1, "foreign: misaligned");
+    expect(bfree(block + 64) == -1, "foreign: inside a block");
+    expect(brealloc(block + 64, 10) == NULL, "foreign: brealloc inside a block");
+    expect(bfree(block) == 0, "foreign: the block itself");
+
+    free(libc);
+    expect_heap_ok("foreign");
+}
+
+/*
+ * Every kind of block freed twice.
+ */
+static void test_double_free(void) {
+    char *block = balloc(300);
+    char *small = balloc(24);
+    char *big = balloc(BIG_SIZE);
+    char *keep = balloc(300);
+
+    expect(block != NULL && small != NULL && big != NULL && keep != NULL, "double free: balloc");
+    expect(bfree(block) == 0, "double free: block");
+    expect(bfree(block) == -1, "double free: block again");
+    expect(brealloc(block, 10) == NULL, "double free: brealloc of a freed block");
+    expect(bfree(small) == 0, "double free: small block");
+    expect(bfree(small) == -1, "double free: small block again");
+    expect(bfree(big) == 0, "double free: mapped block");
+    expect(bfree(big) == -1, "double free: mapped block again");
+    expect_heap_ok("double free");
+
+    // a block merged into its free neighbor keeps a stale header
+    char *first = balloc(300);
+    char *second = balloc(300);
+    expect(bfree(first) == 0 && bfree(second) == 0, "double free: neighbors");
+    expect(bfree(second) == -1, "double free: merged block");
+    expect_heap_ok("double free merged");
+
+    // a batch with the same block twice frees it once
+    void *batch[3];
+    expect(balloc_batch(200, 2, batch) == 2, "double free: balloc_batch");
+    batch[2] = batch[0];
+    expect(bfree_batch(batch, 3) == -1, "double free: batch duplicate");
+    expect_heap_ok("double free batch");
+
+    expect(bfree(keep) == 0, "double free: keep");
+    expect_heap_ok("double free end");
+}
+
+/*
+ * A batch that the free holes hold together is carved from them without
+ * growing the heap, like the same number of balloc calls.
+ */
+static void test_batch_holes(void) {
+    arena *a = arena_create(HEAP_SIZE / 4);
+    expect(a != NULL, "batch: arena_create");
+    if (a == NULL) {
+	    return;
+    }
+    arena_set_mmap_threshold(a, 0);
+
+    // every other block becomes a hole, the end of the heap is taken
+    void *blocks[2 * HOLES];
+    for (int i = 0; i < 2 * HOLES; i++) {
+	    blocks[i] = arena_balloc(a, HOLE_SIZE);
+	    expect(blocks[i] != NULL, "batch: arena_balloc");
+    }
+    heapStats before;
+    arena_stats(a, &before);
+    void *top = before.largest_free > 64 ? arena_balloc(a, before.largest_free - 64) : NULL;
+    for (int i = 0; i < 2 * HOLES; i += 2) {
+	    expect(arena_bfree(a, blocks[i]) == 0, "batch: free a hole");
+    }
+    arena_stats(a, &before);
+
+    void *out[64];
+    expect(arena_balloc_batch(a, HOLE_SIZE, 64, out) == 64, "batch: arena_balloc_batch");
+    heapStats after;
+    arena_stats(a, &after);
+    expect(after.grows == before.grows, "batch: the heap did not grow");
+    expect(after.heap_size == before.heap_size, "batch: heap size unchanged");
+    expect(after.free_blocks == before.free_blocks - 64, "batch: 64 holes used");
+    expect(arena_check(a) == 0, "batch: arena_check");
+
+    expect(arena_bfree_batch(a, out, 64) == 0, "batch: arena_bfree_batch");
+    if (top != NULL) {
+	    arena_bfree(a, top);
+    }
+    expect(arena_check(a) == 0, "batch: arena_check at the end");
+    arena_destroy(a);
+}
+
+#ifdef HEAP_THREAD_SAFE
+static arena *remote_arena;
+static void *remote_blocks[5];
+
+/*
+ * Function for freeing the owner's blocks from another thread.
+ */
+static void* remote_free(void *arg) {
+    (void)arg;
+    arena *a = remote_arena;
+    int local;
+
+    expect(arena_bfree(a, remote_blocks[0]) == 0, "remote: free");
+    expect(arena_bfree(a, remote_blocks[0]) == -1, "remote: queued block again");
+    expect(arena_bfree(a, remote_blocks[1]) == -1, "remote: block the owner freed");
+    expect(arena_bfree(a, remote_blocks[2]) == 0, "remote: mapped block");
+    expect(arena_bfree(a, remote_blocks[2]) == -1, "remote: mapped block again");
+    expect(arena_bfree(a, (char*)remote_blocks[3] + 16) == -1, "remote: inside a block");
+    expect(arena_bfree(a, &local) == -1, "remote: stack address");
+    return NULL;
+}
+
+/*
+ * Frees from a thread other than the arena's owner.
+ */
+static void test_remote_free(void) {
+    arena *a = arena_create(HEAP_SIZE);
+    expect(a != NULL, "remote: arena_create");
+    if (a == NULL) {
+	    return;
+    }
+    arena_set_mmap_threshold(a, HEAP_SIZE);
+    remote_arena = a;
+    remote_blocks[0] = arena_balloc(a, 500);
+    remote_blocks[1] = arena_balloc(a, 500);
+    remote_blocks[2] = arena_balloc(a, 2 * HEAP_SIZE);
+    remote_blocks[3] = arena_balloc(a, 500);
+    remote_blocks[4] = arena_balloc(a, 500);
+    expect(arena_bfree(a, remote_blocks[1]) == 0, "remote: owner free");
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, remote_free, NULL) != 0) {
+	    expect(0, "remote: pthread_create");
+	    arena_destroy(a);
+	    return;
+    }
+    pthread_join(thread, NULL);
+
+    // the owner cannot free what is still queued, the queue frees it once
+    expect(arena_bfree(a, remote_blocks[0]) == -1, "remote: owner frees a queued block");
+    expect(arena_bfree(a, remote_blocks[2]) == -1, "remote: owner frees a queued mapped block");
+    expect(arena_brealloc(a, remote_blocks[0], 10) == NULL, "remote: owner resizes a queued block");
+    expect(arena_check(a) == 0, "remote: arena_check");
+
+    heapStats stats;
+    arena_stats(a, &stats);
+    expect(stats.mapped_blocks == 0, "remote: mapped block unmapped");
+    expect(arena_bfree(a, remote_blocks[0]) == -1, "remote: drained block again");
+    expect(arena_bfree(a, remote_blocks[3]) == 0 && arena_bfree(a, remote_blocks[4]) == 0, "remote: the rest");
+    expect(arena_check(a) == 0, "remote: arena_check at the end");
+    arena_destroy(a);
+}
+#endif
+
+int main(void) {
+    if (init_heap(HEAP_SIZE) != 0) {
+	    fprintf(stderr, "init_heap failed\n");
+	    return 1;
+    }
+    // the rejected frees print their errors, only failures matter here
+    test_foreign();
+    test_double_free();
+    test_batch_holes();
+#ifdef HEAP_THREAD_SAFE
+    test_remote_free();
+#endif
+    expect_heap_ok("end");
+
+    if (failures != 0) {
+	    fprintf(stderr, "%d checks failed\n", failures);
+	    return 1;
+    }
+    printf("heap_test passed\n");
+    return 0;
+}
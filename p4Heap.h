@@ -0,0 +1,159 @@
+#ifndef __p4Heap_h
+#define __p4Heap_h
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Flags for init_heap_flags() and arena_create_flags().
+ */
+#define HEAP_HUGE_PAGES 1   // back the heap with huge pages if possible
+#define HEAP_POPULATE   2   // fault in the heap's pages up front
+#define HEAP_GOOD_FIT   4   // place blocks by bounded good fit
+#define HEAP_NEXT_FIT   8   // place blocks by roving next fit
+#define HEAP_NUMA       16  // one arena per NUMA node, init_heap_flags() only
+#define HEAP_FILE       32  // heap lives in a file, set by init_heap_file()
+#define HEAP_SHARED     64  // heap shared by processes, set by arena_open_shm()
+
+/*
+ * Heap statistics, see heap_stats(). All sizes are in bytes and include
+ * block headers.
+ */
+typedef struct heapStats {
+    size_t heap_size;       // bytes from the first block to the end mark
+    size_t bytes_in_use;    // bytes in allocated blocks and slab runs
+    size_t bytes_free;      // bytes in free blocks
+    size_t used_blocks;     // allocated blocks, a slab run counts as one
+    size_t free_blocks;     // free blocks
+    size_t slab_objects;    // slab objects in use
+    size_t largest_free;    // size of the largest free block
+    size_t failed_allocs;   // allocation calls that found no space
+    size_t splits;          // blocks split in two
+    size_t merges;          // pairs of neighboring blocks merged into one
+    size_t grows;           // times the heap grew
+    size_t mapped_blocks;   // blocks with a mapping of their own, not
+                            // counted in any of the above
+    size_t mapped_bytes;    // bytes those mappings take
+    size_t requested_bytes; // bytes asked for by all allocations so far
+    size_t padding_bytes;   // bytes those allocations got on top, from
+                            // rounding up the request
+} heapStats;
+
+/*
+ * Formats for heap_report().
+ */
+#define HEAP_REPORT_JSON       0
+#define HEAP_REPORT_CSV        1
+#define HEAP_REPORT_CSV_HEADER 2
+
+/*
+ * Allocation trace file, see heap_trace_start(). A heapTraceHeader followed
+ * by heapTraceRecords in native byte order. The records of one thread are
+ * in time order, those of different threads are interleaved in chunks.
+ */
+#define HEAP_TRACE_MAGIC   "p4htrc1"
+#define HEAP_TRACE_BALLOC  1        // balloc(), balloc_batch()
+#define HEAP_TRACE_ALIGNED 2        // balloc_aligned(), arg is the alignment
+#define HEAP_TRACE_REALLOC 3        // brealloc(), arg is the old block
+#define HEAP_TRACE_BFREE   4        // bfree(), bfree_batch()
+#define HEAP_TRACE_NULL    (~0ULL)  // offset of a NULL pointer
+
+typedef struct heapTraceHeader {
+    char magic[8];                  // HEAP_TRACE_MAGIC
+    unsigned long long heap_size;   // heap size when the trace started
+    unsigned int record_size;       // sizeof(heapTraceRecord)
+    unsigned int reserved;
+} heapTraceHeader;
+
+typedef struct heapTraceRecord {
+    unsigned long long time;        // ns of CLOCK_MONOTONIC
+    unsigned long long size;        // requested size, 0 for bfree
+    unsigned long long offset;      // block's offset from the first block
+    unsigned long long arg;         // see HEAP_TRACE_*
+    unsigned int op;                // HEAP_TRACE_*
+    unsigned int thread;            // recording thread, numbered from 0
+} heapTraceRecord;
+
+/*
+ * Handle of a movable block, see balloc_handle(). 0 is never a handle.
+ */
+typedef size_t heapHandle;
+
+int   init_heap(size_t sizeOfRegion);
+int   init_heap_flags(size_t sizeOfRegion, int flags);
+int   init_heap_file(const char *path, size_t sizeOfRegion, int flags);
+void  disp_heap();
+void* balloc(size_t size);
+void* balloc_aligned(size_t size, size_t align);
+void* bcalloc(size_t n, size_t size);
+void* brealloc(void *ptr, size_t size);
+size_t balloc_batch(size_t size, size_t count, void **out);
+int   bfree_batch(void **ptrs, size_t n);
+int   bfree(void *ptr);
+int   coalesce();
+size_t coalesce_step(size_t maxBlocks);
+int   heap_stats(heapStats *stats);
+int   heap_check(void);
+int   heap_report(FILE *out, int format);
+int   heap_set_mmap_threshold(size_t threshold);
+void* heap_root(void);
+int   heap_set_root(void *ptr);
+int   heap_sync(void);
+int   heap_trace_start(const char *path);
+int   heap_trace_stop(void);
+int   heap_profile_start(size_t sampleBytes);
+int   heap_profile_stop(void);
+int   heap_profile_dump(FILE *out);
+heapHandle balloc_handle(size_t size);
+int   bfree_handle(heapHandle h);
+void* handle_pin(heapHandle h);
+int   handle_unpin(heapHandle h);
+size_t compact();
+
+/*
+ * Independent heaps, each with its own mapped region.
+ * balloc/bfree/coalesce/disp_heap work on the default arena that
+ * init_heap() creates.
+ */
+typedef struct arena arena;
+
+arena* arena_create(size_t sizeOfRegion);
+arena* arena_create_flags(size_t sizeOfRegion, int flags);
+arena* arena_create_node(size_t sizeOfRegion, int flags, int node);
+int    arena_destroy(arena *a);
+arena* arena_open_shm(const char *name, size_t sizeOfRegion);
+int    arena_close_shm(arena *a);
+int    arena_set_owner(arena *a);
+int    arena_set_mmap_threshold(arena *a, size_t threshold);
+void*  arena_balloc(arena *a, size_t size);
+void*  arena_balloc_aligned(arena *a, size_t size, size_t align);
+void*  arena_bcalloc(arena *a, size_t n, size_t size);
+void*  arena_brealloc(arena *a, void *ptr, size_t size);
+size_t arena_balloc_batch(arena *a, size_t size, size_t count, void **out);
+int    arena_bfree_batch(arena *a, void **ptrs, size_t n);
+int    arena_bfree(arena *a, void *ptr);
+heapHandle arena_balloc_handle(arena *a, size_t size);
+int    arena_bfree_handle(arena *a, heapHandle h);
+void*  arena_handle_pin(arena *a, heapHandle h);
+int    arena_handle_unpin(arena *a, heapHandle h);
+size_t arena_compact(arena *a);
+int    arena_coalesce(arena *a);
+size_t arena_coalesce_step(arena *a, size_t maxBlocks);
+int    arena_stats(arena *a, heapStats *stats);
+int    arena_check(arena *a);
+int    arena_report(arena *a, FILE *out, int format);
+void   arena_disp_heap(arena *a);
+
+/*
+ * Bump regions, pointer-bump allocation from one large block with a bulk
+ * reset, see region_begin().
+ */
+typedef struct heapRegion heapRegion;
+
+heapRegion* region_begin(size_t capacity);
+heapRegion* arena_region_begin(arena *a, size_t capacity);
+void*  region_alloc(heapRegion *r, size_t n);
+void   region_reset(heapRegion *r);
+int    region_end(heapRegion *r);
+
+#endif // __p4Heap_h